@@ -0,0 +1,226 @@
+"""End-to-end benchmarks of the fetch and upload paths against a local mock server.
+
+Starts bench/mock_server.py on a free local port and measures
+
+  remote-open (cold)   latency of opening http:// URLs of small files through
+                       libvdi.so (each open downloads the file)
+  remote-open (cached) latency of opening vdi://VIEW/FILE paths whose files
+                       have been downloaded before
+  download             throughput of downloading a large file through libvdi.so
+  view metadata        latency of 'vdi view files' with and without the
+                       metadata cache
+  upload               throughput of 'vdi view upload'
+
+Everything runs on the local host and in a temporary directory, no network
+access is needed. Usually run via 'make bench-e2e' in the main directory.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    if not values:
+        return float("nan")
+    index = min(len(values) - 1, int(round(fraction * (len(values) - 1))))
+    return values[index]
+
+
+class MockServer:
+    """Runs mock_server.py in a subprocess."""
+
+    def __init__(self, args):
+        cmd = [sys.executable, os.path.join(BENCH_DIR, "mock_server.py"), "--port", "0"] + args
+        self.process = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+        line = self.process.stdout.readline().strip()
+        if not line.startswith("listening on "):
+            self.process.kill()
+            raise RuntimeError("mock server did not start: '%s'" % line)
+        self.base_url = line[len("listening on "):]
+
+    def request(self, method, path, data=None, headers=None):
+        request = urllib.request.Request(self.base_url + path, data=data, method=method,
+                                         headers=headers or {})
+        with urllib.request.urlopen(request) as response:
+            return json.loads(response.read() or b"null")
+
+    def stats(self):
+        return self.request("GET", "/_stats")
+
+    def stop(self):
+        self.process.terminate()
+        self.process.wait()
+
+
+class Bench:
+    def __init__(self, options, server, workdir):
+        self.options = options
+        self.server = server
+        self.workdir = workdir
+        self.results = []
+        self.env = dict(os.environ)
+        self.env.update({
+            "HOME": workdir,
+            "VDI_BASE_URL": server.base_url,
+            "VDI_CACHE_DIR": os.path.join(workdir, "cache"),
+            "VDI_DOWNLOAD_BASE": os.path.join(workdir, "downloads"),
+            "VDI_LOG_DIR": os.path.join(workdir, "logs"),
+        })
+        self.env.pop("VDI_LOG_DEBUG_LEVEL", None)
+
+    def record(self, name, unit, value, details=""):
+        self.results.append({"benchmark": name, "value": value, "unit": unit, "details": details})
+
+    def create_view(self, name, files):
+        """Create view NAME on the server with files {filename: bytes}."""
+        view = self.server.request("POST", "/views", json.dumps({"name": name}).encode(),
+                                   {"Content-Type": "application/json"})
+        for filename, data in files.items():
+            boundary = "vdi-bench-boundary"
+            body = ("--%s\r\nContent-Disposition: form-data; name=\"viewId\"\r\n\r\n%d\r\n"
+                    "--%s\r\nContent-Disposition: form-data; name=\"files\"; filename=\"%s\"\r\n"
+                    "Content-Type: application/octet-stream\r\n\r\n"
+                    % (boundary, view["id"], boundary, filename)).encode() + data + \
+                   ("\r\n--%s--\r\n" % boundary).encode()
+            self.server.request("POST", "/data/" + name, body,
+                                {"Content-Type": "multipart/form-data; boundary=%s" % boundary})
+        return view
+
+    def remote_open(self, iterations, paths):
+        """Run the remote_open helper with libvdi.so preloaded."""
+        env = dict(self.env, LD_PRELOAD=os.path.abspath(self.options.libvdi))
+        output = subprocess.run([self.options.remote_open, str(iterations)] + paths,
+                                env=env, check=True, capture_output=True, text=True).stdout
+        return json.loads(output.strip().splitlines()[-1])
+
+    def vdi(self, *args):
+        start = time.monotonic()
+        subprocess.run(["bash", self.options.vdi] + list(args), env=self.env, check=True,
+                       capture_output=True, text=True)
+        return time.monotonic() - start
+
+    def clear_downloads(self):
+        shutil.rmtree(self.env["VDI_DOWNLOAD_BASE"], ignore_errors=True)
+
+    def bench_remote_open(self):
+        count = self.options.small_files
+        files = {"small%04d.dat" % i: os.urandom(self.options.small_size) for i in range(count)}
+        self.create_view("bench-small", files)
+
+        # cold: every open downloads the file
+        self.clear_downloads()
+        urls = ["%s/download/bench-small/%s" % (self.server.base_url, name) for name in files]
+        result = self.remote_open(len(urls), urls)
+        latencies = result["latencies"]
+        self.record("remote-open cold p50", "ms", 1000 * statistics.median(latencies),
+                    "%d http:// opens of %d-byte files" % (len(urls), self.options.small_size))
+        self.record("remote-open cold p95", "ms", 1000 * percentile(latencies, 0.95))
+
+        # cached: vdi:// opens of files downloaded before only use the view index
+        paths = ["vdi://bench-small/%s" % name for name in files]
+        self.remote_open(len(paths), paths)
+        before = self.server.stats()["requests"]
+        iterations = self.options.iterations
+        result = self.remote_open(iterations, paths)
+        requests = self.server.stats()["requests"] - before
+        latencies = result["latencies"]
+        self.record("remote-open cached p50", "ms", 1000 * statistics.median(latencies),
+                    "%d vdi:// opens, %d server requests" % (iterations, requests))
+        self.record("remote-open cached p95", "ms", 1000 * percentile(latencies, 0.95))
+        if result["failures"]:
+            self.record("remote-open failures", "count", result["failures"])
+
+    def bench_download(self):
+        size = self.options.size_mb * 1024 * 1024
+        self.create_view("bench-large", {"large.dat": os.urandom(size)})
+        url = "%s/download/bench-large/large.dat" % self.server.base_url
+        rates = []
+        for _ in range(self.options.repetitions):
+            self.clear_downloads()
+            result = self.remote_open(1, [url])
+            rates.append(result["bytes"] / (1024 * 1024) / result["latencies"][0])
+        self.record("download throughput", "MiB/s", statistics.median(rates),
+                    "%d MiB, median of %d" % (self.options.size_mb, len(rates)))
+
+    def bench_view_metadata(self):
+        self.create_view("bench-meta", {"file%04d.dat" % i: b"x" for i in range(self.options.small_files)})
+        iterations = max(1, self.options.iterations // 10)
+        for label, extra in (("uncached", ["--no-cache"]), ("cached", [])):
+            before = self.server.stats()["requests"]
+            times = [self.vdi("view", "--base-url", self.server.base_url, *extra, "files", "bench-meta")
+                     for _ in range(iterations)]
+            requests = self.server.stats()["requests"] - before
+            self.record("view files %s p50" % label, "ms", 1000 * statistics.median(times),
+                        "%d runs, %d server requests" % (iterations, requests))
+
+    def bench_upload(self):
+        size = self.options.size_mb * 1024 * 1024
+        self.create_view("bench-upload", {})
+        path = os.path.join(self.workdir, "upload.dat")
+        with open(path, "wb") as f:
+            f.write(os.urandom(size))
+        rates = []
+        for _ in range(self.options.repetitions):
+            elapsed = self.vdi("view", "--base-url", self.server.base_url, "upload", "bench-upload", path)
+            rates.append(self.options.size_mb / elapsed)
+        self.record("upload throughput", "MiB/s", statistics.median(rates),
+                    "%d MiB via 'vdi view upload', median of %d" % (self.options.size_mb, len(rates)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="End-to-end benchmarks against a local mock VDI server.")
+    parser.add_argument("--libvdi", required=True, help="path to libvdi.so")
+    parser.add_argument("--vdi", required=True, help="path to the script vdi")
+    parser.add_argument("--remote-open", required=True, help="path to the remote_open helper")
+    parser.add_argument("--latency", default="0", help="latency per request in ms injected by the server")
+    parser.add_argument("--bandwidth", default="0", help="bandwidth limit in bytes/s of the server (0: unlimited)")
+    parser.add_argument("--error-rate", default="0", help="fraction of requests the server fails")
+    parser.add_argument("--small-files", type=int, default=50, help="number of small files")
+    parser.add_argument("--small-size", type=int, default=4096, help="size of small files in bytes")
+    parser.add_argument("--size-mb", type=int, default=64, help="size of the large file in MiB")
+    parser.add_argument("--iterations", type=int, default=500, help="number of cached opens")
+    parser.add_argument("--repetitions", type=int, default=3, help="repetitions of throughput measurements")
+    parser.add_argument("--only", action="append", choices=["remote-open", "download", "view-metadata", "upload"],
+                        help="run only the given benchmark (may be given multiple times)")
+    parser.add_argument("--json", action="store_true", help="print results as JSON")
+    options = parser.parse_args()
+
+    server = MockServer(["--latency", options.latency, "--bandwidth", options.bandwidth,
+                         "--error-rate", options.error_rate, "--seed", "1"])
+    workdir = tempfile.mkdtemp(prefix="vdi-bench-")
+    try:
+        bench = Bench(options, server, workdir)
+        benchmarks = {
+            "remote-open": bench.bench_remote_open,
+            "download": bench.bench_download,
+            "view-metadata": bench.bench_view_metadata,
+            "upload": bench.bench_upload,
+        }
+        for name, run in benchmarks.items():
+            if options.only is None or name in options.only:
+                run()
+    finally:
+        server.stop()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    if options.json:
+        print(json.dumps(bench.results, indent=2))
+    else:
+        print("%-28s %12s  %-6s %s" % ("benchmark", "value", "unit", "details"))
+        for result in bench.results:
+            print("%-28s %12.3f  %-6s %s" % (result["benchmark"], result["value"], result["unit"], result["details"]))
+
+
+if __name__ == "__main__":
+    main()
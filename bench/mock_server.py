@@ -0,0 +1,384 @@
+"""Local stand-in for the VDI server.
+
+Implements the REST endpoints used by the script 'vdi' and by libvdi so that
+they can be exercised and benchmarked without a live server:
+
+  GET    /views                      list views
+  POST   /views                      create a view ({"name": NAME})
+  DELETE /views/ID                   delete a view
+  GET    /views/NAME/files           list files of a view
+  DELETE /views/ID/FILE_ID           remove a file from a view
+  POST   /data/VIEW                  upload files (multipart form with 'viewId' and 'files')
+  GET    /download/VIEW/FILE         download a file (supports Range and If-None-Match)
+  PUT    /download/VIEW/FILE         store a file (e.g., written by libvdi to an URL opened for writing)
+  GET    /_stats                     number of requests and bytes sent/received so far
+
+Listings and downloads carry an ETag and answer If-None-Match with 304.
+With '--gzip', complete downloads are sent with 'Content-Encoding: gzip' to
+clients that accept it.
+Latency, bandwidth and errors can be injected with command line options.
+All data is kept in memory (optionally preloaded from directories).
+
+Run 'python3 mock_server.py -h' for the options. With '--port 0' a free port
+is chosen and printed as 'listening on http://127.0.0.1:PORT'.
+"""
+
+import argparse
+import email.parser
+import email.policy
+import gzip
+import hashlib
+import json
+import os
+import random
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Store:
+    """Views and their files, protected by a lock."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.views = {}  # id -> {"id", "name", "files": {file_id: {"id", "filename", "data"}}}
+        self.next_view_id = 1
+        self.next_file_id = 1
+
+    def view_by_name(self, name):
+        for view in self.views.values():
+            if view["name"] == name:
+                return view
+        return None
+
+    def create_view(self, name):
+        with self.lock:
+            view = self.view_by_name(name)
+            if view is None:
+                view = {"id": self.next_view_id, "name": name, "files": {}}
+                self.views[view["id"]] = view
+                self.next_view_id += 1
+            return {"id": view["id"], "name": view["name"]}
+
+    def add_file(self, view, filename, data):
+        with self.lock:
+            # uploading a file with an existing name replaces it
+            for file_id, entry in list(view["files"].items()):
+                if entry["filename"] == filename:
+                    del view["files"][file_id]
+            entry = {"id": self.next_file_id, "filename": filename, "data": data}
+            view["files"][entry["id"]] = entry
+            self.next_file_id += 1
+            return entry
+
+
+def etag_of(data):
+    return '"%s"' % hashlib.sha1(data).hexdigest()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "vdi-mock-server/1.0"
+
+    # set by main()
+    store = None
+    options = None
+    stats = {"requests": 0, "bytes_sent": 0, "bytes_received": 0}
+    stats_lock = threading.Lock()
+
+    def log_message(self, fmt, *args):
+        if self.options.verbose:
+            sys.stderr.write("mock_server: %s\n" % (fmt % args))
+
+    # helpers
+    def count(self, requests=0, sent=0, received=0):
+        with self.stats_lock:
+            self.stats["requests"] += requests
+            self.stats["bytes_sent"] += sent
+            self.stats["bytes_received"] += received
+
+    def inject(self):
+        """Apply latency and error injection, returns True if an error was sent."""
+        self.count(requests=1)
+        if self.options.latency > 0:
+            time.sleep(self.options.latency / 1000.0)
+        if self.options.error_rate > 0 and random.random() < self.options.error_rate:
+            self.send_json(503, {"message": "injected error"})
+            return True
+        return False
+
+    def write_throttled(self, data):
+        """Write data to the client, limited to the configured bandwidth."""
+        chunk_size = 64 * 1024
+        bandwidth = self.options.bandwidth
+        start = time.monotonic()
+        sent = 0
+        for offset in range(0, len(data), chunk_size):
+            chunk = data[offset:offset + chunk_size]
+            self.wfile.write(chunk)
+            sent += len(chunk)
+            if bandwidth > 0:
+                ahead = sent / bandwidth - (time.monotonic() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+        self.count(sent=sent)
+
+    def send_body(self, status, body, content_type, headers=None):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.end_headers()
+        if self.command != "HEAD":
+            self.write_throttled(body)
+
+    def send_json(self, status, obj, etag=False):
+        body = json.dumps(obj).encode()
+        headers = {}
+        if etag:
+            tag = etag_of(body)
+            headers["ETag"] = tag
+            if self.headers.get("If-None-Match") == tag:
+                self.send_response(304)
+                self.send_header("ETag", tag)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+        self.send_body(status, body, "application/json", headers)
+
+    def read_body(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            data = bytearray()
+            while True:
+                size = int(self.rfile.readline().split(b";")[0].strip(), 16)
+                if size == 0:
+                    # skip trailers
+                    while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+                        pass
+                    break
+                data += self.rfile.read(size)
+                self.rfile.readline()
+            data = bytes(data)
+        else:
+            data = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        self.count(received=len(data))
+        return data
+
+    def path_parts(self):
+        path = urllib.parse.urlparse(self.path).path
+        return [urllib.parse.unquote(part) for part in path.strip("/").split("/")]
+
+    # handlers
+    def do_GET(self):
+        parts = self.path_parts()
+        if parts == ["_stats"]:
+            # counters of the server itself, not subject to injection or counting
+            with self.stats_lock:
+                body = json.dumps(self.stats).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+        if self.inject():
+            return
+        store = self.store
+        if parts == ["views"]:
+            with store.lock:
+                views = [{"id": v["id"], "name": v["name"]} for v in store.views.values()]
+            self.send_json(200, views, etag=True)
+        elif len(parts) == 3 and parts[0] == "views" and parts[2] == "files":
+            with store.lock:
+                view = store.view_by_name(parts[1])
+                files = [] if view is None else [
+                    {"id": f["id"], "filename": f["filename"], "size": len(f["data"])}
+                    for f in view["files"].values()]
+            if view is None:
+                self.send_json(404, {"message": "view '%s' not found" % parts[1]})
+            elif not files:
+                self.send_json(200, [], etag=True)
+            else:
+                self.send_json(200, {"files": files}, etag=True)
+        elif len(parts) >= 3 and parts[0] == "download":
+            self.download(parts[1], "/".join(parts[2:]))
+        else:
+            self.send_json(404, {"message": "not found"})
+
+    do_HEAD = do_GET
+
+    def download(self, view_name, filename):
+        with self.store.lock:
+            view = self.store.view_by_name(view_name)
+            entry = None
+            if view is not None:
+                entry = next((f for f in view["files"].values() if f["filename"] == filename), None)
+        if entry is None:
+            self.send_json(404, {"message": "file not found"})
+            return
+        data = entry["data"]
+        tag = etag_of(data)
+        headers = {"ETag": tag, "Accept-Ranges": "bytes"}
+        if self.headers.get("If-None-Match") == tag:
+            self.send_response(304)
+            self.send_header("ETag", tag)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        range_header = self.headers.get("Range")
+        if range_header and range_header.startswith("bytes=") and "," not in range_header:
+            first, _, last = range_header[len("bytes="):].partition("-")
+            size = len(data)
+            if first == "":
+                start, end = max(0, size - int(last)), size - 1
+            else:
+                start = int(first)
+                end = min(int(last), size - 1) if last else size - 1
+            if start >= size or start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % size)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            headers["Content-Range"] = "bytes %d-%d/%d" % (start, end, size)
+            self.send_body(206, data[start:end + 1], "application/octet-stream", headers)
+        elif self.options.gzip and "gzip" in self.headers.get("Accept-Encoding", ""):
+            # the ETag stays that of the identity, as the content is the same
+            headers["Content-Encoding"] = "gzip"
+            with self.store.lock:
+                if "gzip" not in entry:
+                    entry["gzip"] = gzip.compress(data, compresslevel=6, mtime=0)
+                encoded = entry["gzip"]
+            self.send_body(200, encoded, "application/octet-stream", headers)
+        else:
+            self.send_body(200, data, "application/octet-stream", headers)
+
+    def do_POST(self):
+        if self.inject():
+            self.read_body()
+            return
+        parts = self.path_parts()
+        body = self.read_body()
+        if parts == ["views"]:
+            try:
+                name = json.loads(body)["name"]
+            except (ValueError, KeyError, TypeError):
+                self.send_json(400, {"message": "missing view name"})
+                return
+            self.send_json(200, self.store.create_view(name))
+        elif len(parts) == 2 and parts[0] == "data":
+            view = self.store.view_by_name(parts[1])
+            if view is None:
+                self.send_json(404, {"message": "view '%s' not found" % parts[1]})
+                return
+            uploaded = []
+            for filename, data in self.parse_multipart(body):
+                self.store.add_file(view, filename, data)
+                uploaded.append(filename)
+            if not uploaded:
+                self.send_json(400, {"message": "no files uploaded"})
+            else:
+                self.send_json(200, {"message": "uploaded %s" % ", ".join(uploaded)})
+        else:
+            self.send_json(404, {"message": "not found"})
+
+    def do_PUT(self):
+        if self.inject():
+            self.read_body()
+            return
+        parts = self.path_parts()
+        body = self.read_body()
+        if len(parts) >= 3 and parts[0] == "download":
+            view = self.store.view_by_name(parts[1])
+            if view is None:
+                self.send_json(404, {"message": "view '%s' not found" % parts[1]})
+                return
+            self.store.add_file(view, "/".join(parts[2:]), body)
+            self.send_json(200, {"message": "stored %s" % "/".join(parts[2:])})
+        else:
+            self.send_json(404, {"message": "not found"})
+
+    def parse_multipart(self, body):
+        content_type = self.headers.get("Content-Type", "")
+        if not content_type.startswith("multipart/form-data"):
+            return []
+        message = email.parser.BytesParser(policy=email.policy.HTTP).parsebytes(
+            b"Content-Type: " + content_type.encode() + b"\r\n\r\n" + body)
+        files = []
+        for part in message.iter_parts():
+            if part.get_param("name", header="content-disposition") == "files":
+                files.append((part.get_filename() or "unnamed", part.get_payload(decode=True) or b""))
+        return files
+
+    def do_DELETE(self):
+        if self.inject():
+            return
+        parts = self.path_parts()
+        store = self.store
+        if len(parts) == 2 and parts[0] == "views":
+            with store.lock:
+                view = store.views.pop(int(parts[1]), None) if parts[1].isdigit() else None
+            if view is None:
+                self.send_json(404, {"message": "view '%s' not found" % parts[1]})
+            else:
+                self.send_json(200, {"message": "deleted view '%s'" % view["name"]})
+        elif len(parts) == 3 and parts[0] == "views":
+            with store.lock:
+                view = store.views.get(int(parts[1])) if parts[1].isdigit() else None
+                entry = None
+                if view is not None and parts[2].isdigit():
+                    entry = view["files"].pop(int(parts[2]), None)
+            if entry is None:
+                self.send_json(404, {"message": "file not found"})
+            else:
+                self.send_json(200, {"message": "removed file '%s'" % entry["filename"]})
+        else:
+            self.send_json(404, {"message": "not found"})
+
+
+def preload(store, spec):
+    """Load the files of directory DIR into view VIEW (spec is VIEW=DIR)."""
+    view_name, _, directory = spec.partition("=")
+    view = store.view_by_name(store.create_view(view_name)["name"])
+    for root, _, names in os.walk(directory):
+        for name in names:
+            path = os.path.join(root, name)
+            with open(path, "rb") as f:
+                store.add_file(view, os.path.relpath(path, directory), f.read())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for the VDI server.")
+    parser.add_argument("--host", default="127.0.0.1", help="address to listen on (default: 127.0.0.1)")
+    parser.add_argument("--port", type=int, default=8080, help="port to listen on, 0 picks a free port (default: 8080)")
+    parser.add_argument("--latency", type=float, default=0.0, help="added latency per request in milliseconds")
+    parser.add_argument("--bandwidth", type=float, default=0.0, help="bandwidth limit per response in bytes/s (0: unlimited)")
+    parser.add_argument("--error-rate", type=float, default=0.0, help="fraction of requests answered with 503")
+    parser.add_argument("--seed", type=int, default=None, help="seed for the error injection")
+    parser.add_argument("--preload", action="append", default=[], metavar="VIEW=DIR",
+                        help="create VIEW with the files in DIR (may be given multiple times)")
+    parser.add_argument("--gzip", action="store_true",
+                        help="send downloads gzip-encoded to clients that accept it")
+    parser.add_argument("-v", "--verbose", action="store_true", help="log requests to stderr")
+    options = parser.parse_args()
+
+    random.seed(options.seed)
+    Handler.store = Store()
+    Handler.options = options
+    for spec in options.preload:
+        preload(Handler.store, spec)
+
+    server = ThreadingHTTPServer((options.host, options.port), Handler)
+    server.daemon_threads = True
+    print("listening on http://%s:%d" % (options.host, server.server_address[1]), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,49 @@
+// Opens a path repeatedly, reads it completely and closes it again; prints the
+// latency of each iteration (open until close) and the bytes read as JSON.
+// Run under LD_PRELOAD=libvdi.so to measure remote opens (URLs and vdi://
+// paths) including the fetch path of the library.
+//
+// Usage: remote_open ITERATIONS PATH [PATH ...]
+//   If several paths are given, they are opened round robin.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s ITERATIONS PATH [PATH ...]\n", argv[0]);
+        return 1;
+    }
+    int iterations = atoi(argv[1]);
+    int num_paths = argc - 2;
+    static char buffer[1 << 20];
+    long long total_bytes = 0;
+    int failures = 0;
+
+    printf("{\"latencies\": [");
+    for (int i = 0; i < iterations; i++) {
+        const char *path = argv[2 + i % num_paths];
+        double start = now_seconds();
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            failures++;
+        } else {
+            ssize_t n;
+            while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+                total_bytes += n;
+            }
+            close(fd);
+        }
+        printf("%s%.9f", i == 0 ? "" : ", ", now_seconds() - start);
+    }
+    printf("], \"bytes\": %lld, \"failures\": %d}\n", total_bytes, failures);
+    return 0;
+}
@@ -0,0 +1,93 @@
+import argparse
+import ctypes
+import os
+
+# hint interface of libvdi.so (see src/vdi_wrapper/vdi.h) for Python programs
+# run with 'vdi run'; without the library the functions do nothing
+
+# mirrors struct vdi_stats of vdi.h
+class VdiStats(ctypes.Structure):
+    _fields_ = [
+        ('size', ctypes.c_uint32),
+        ('version', ctypes.c_uint32),
+        ('opens', ctypes.c_uint64),
+        ('logged_lines', ctypes.c_uint64),
+        ('logged_bytes', ctypes.c_uint64),
+        ('dropped', ctypes.c_uint64),
+        ('downloads', ctypes.c_uint64),
+        ('download_bytes', ctypes.c_uint64),
+        ('downloads_in_flight', ctypes.c_int64),
+        ('cache_hits', ctypes.c_uint64),
+        ('prefetches_queued', ctypes.c_uint64),
+        ('prefetches_done', ctypes.c_uint64),
+        ('prefetches_cached', ctypes.c_uint64),
+        ('prefetches_failed', ctypes.c_uint64),
+        ('prefetches_used', ctypes.c_uint64),
+    ]
+
+# the symbols of the preloaded library are found in the process itself
+_process = ctypes.CDLL(None, use_errno=True)
+_vdi = _process if hasattr(_process, 'vdi_prefetch') else None
+
+if _vdi is not None:
+    _vdi.vdi_prefetch.argtypes = [ctypes.c_char_p]
+    _vdi.vdi_evict.argtypes = [ctypes.c_char_p]
+    _vdi.vdi_get_stats.argtypes = [ctypes.POINTER(VdiStats)]
+
+def available():
+    return _vdi is not None
+
+def _check(ret):
+    if ret == -1:
+        errno = ctypes.get_errno()
+        raise OSError(errno, os.strerror(errno))
+    return ret
+
+def prefetch(*paths):
+    """queues paths (URLs, vdi:// paths or mapped paths) for a download in the background"""
+    for path in paths:
+        if _vdi is not None:
+            _check(_vdi.vdi_prefetch(os.fsencode(path)))
+
+def evict(path):
+    """removes the downloaded copy of path, returns False if it is in use or there is none"""
+    if _vdi is None:
+        return False
+    try:
+        _check(_vdi.vdi_evict(os.fsencode(path)))
+    except OSError:
+        return False
+    return True
+
+def flush_log():
+    if _vdi is not None:
+        _check(_vdi.vdi_flush_log())
+
+def stats():
+    """returns the counters of the process as a dict (empty without the library)"""
+    if _vdi is None:
+        return {}
+    stats = VdiStats()
+    stats.size = ctypes.sizeof(VdiStats)
+    _check(_vdi.vdi_get_stats(ctypes.byref(stats)))
+    return {name: getattr(stats, name) for name, _ in VdiStats._fields_ if name != 'size'}
+
+if __name__ == '__main__':
+    # create the parser
+    parser = argparse.ArgumentParser(description='Prefetches files, reads them in order and prints the counters of libvdi.so')
+    parser.add_argument('paths', nargs='+', help='URLs, vdi:// paths or mapped paths to read.')
+    parser.add_argument('--evict', action='store_true', help='Remove the downloaded copies after reading them.')
+    args = parser.parse_args()
+
+    if not available():
+        print('libvdi.so is not preloaded, run with: vdi run python3 vdi_hints.py ...')
+    # ask for all files before the first is read
+    prefetch(*args.paths)
+    for path in args.paths:
+        with open(path, 'rb') as f:
+            print(f'{path}: {len(f.read())} bytes')
+        if args.evict:
+            evict(path)
+    flush_log()
+    for name, value in stats().items():
+        print(f'{name}: {value}')
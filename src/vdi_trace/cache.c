@@ -0,0 +1,592 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// vdi-cache: inspects and maintains the download cache of libvdi.so
+//
+// libvdi.so records every download and reuse in the index of the download
+// directory (see cache_index_header in trace.h) and evicts files once the
+// directory exceeds its budget. This program shows the state of the cache
+// (stats), brings the index in line with the directory and evicts files down
+// to the budget (gc) or removes all files (clear). It takes the same lock as
+// libvdi.so, so it is safe to run while programs download files; files that
+// a program has open are never removed.
+
+// temporary files of downloads that were interrupted are removed after this
+#define STALE_TMP_SECONDS 3600
+
+typedef struct {
+    char *dir;
+    int lock_fd;
+    cache_index_header *index;
+    size_t index_size;
+} cache;
+
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a, as in libvdi.so
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static cache_slot *get_slots(cache_index_header *index) {
+    return (cache_slot *)(index + 1);
+}
+
+static size_t get_index_size(uint32_t capacity) {
+    return sizeof(cache_index_header) + (size_t)capacity * sizeof(cache_slot);
+}
+
+// parses sizes such as '1048576', '512K', '100M' or '2G' (as libvdi.so)
+static long long parse_size(const char *value) {
+    char *end;
+    long long size = strtoll(value, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+        case 'K': size *= 1024LL; break;
+        case 'M': size *= 1024LL * 1024; break;
+        case 'G': size *= 1024LL * 1024 * 1024; break;
+        case 'T': size *= 1024LL * 1024 * 1024 * 1024; break;
+    }
+    return size > 0 ? size : 0;
+}
+
+// returns the budget in bytes for value (a size, a percentage of the file
+// system of dir or 'none'), 0 means unlimited
+static long long get_budget(const char *value, const char *dir) {
+    size_t len = strlen(value);
+    if (len > 0 && value[len - 1] == '%') {
+        struct statvfs st;
+        if (statvfs(dir, &st) != 0) {
+            return 0;
+        }
+        return (long long)((double)st.f_blocks * st.f_frsize * atof(value) / 100.0);
+    }
+    return strcmp(value, "none") == 0 ? 0 : parse_size(value);
+}
+
+static char *get_default_download_dir(void) {
+    const char *value = getenv("VDI_DOWNLOAD_BASE");
+    if (value != NULL) {
+        return strdup(value);
+    }
+    struct passwd *pw = getpwuid(getuid());
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/tmp/%s/vdi/downloads", pw == NULL ? "unknown" : pw->pw_name);
+    return strdup(path);
+}
+
+static void unmap_index(cache *c) {
+    if (c->index != NULL) {
+        munmap(c->index, c->index_size);
+        c->index = NULL;
+    }
+}
+
+// maps the index of the cache (creating an empty one if create is set)
+static int map_index(cache *c, bool create) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, CACHE_INDEX_FILENAME);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    bool valid = (size_t)st.st_size >= sizeof(cache_index_header);
+    if (valid) {
+        cache_index_header header;
+        valid = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                memcmp(header.magic, CACHE_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                header.capacity > 0 && (size_t)st.st_size == get_index_size(header.capacity);
+    }
+    if (!valid) {
+        st.st_size = get_index_size(CACHE_INITIAL_CAPACITY);
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, st.st_size) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    c->index = (cache_index_header *)map;
+    c->index_size = st.st_size;
+    if (!valid) {
+        memcpy(c->index->magic, CACHE_INDEX_MAGIC, sizeof(c->index->magic));
+        c->index->capacity = CACHE_INITIAL_CAPACITY;
+    }
+    return 0;
+}
+
+// locks the cache in dir and maps its index
+static int open_cache(cache *c, const char *dir) {
+    memset(c, 0, sizeof(cache));
+    c->dir = strdup(dir);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_LOCK_FILENAME);
+    c->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (c->lock_fd == -1) {
+        fprintf(stderr, "vdi-cache: cannot open '%s': %s\n", path, strerror(errno));
+        free(c->dir);
+        return -1;
+    }
+    while (flock(c->lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "vdi-cache: cannot lock '%s': %s\n", path, strerror(errno));
+            close(c->lock_fd);
+            free(c->dir);
+            return -1;
+        }
+    }
+    if (map_index(c, true) != 0) {
+        fprintf(stderr, "vdi-cache: cannot map the index in '%s': %s\n", dir, strerror(errno));
+        close(c->lock_fd);
+        free(c->dir);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_cache(cache *c) {
+    unmap_index(c);
+    flock(c->lock_fd, LOCK_UN);
+    close(c->lock_fd);
+    free(c->dir);
+}
+
+// returns the slot of name, or (if insert is set) a free slot for it, or NULL
+static cache_slot *find_slot(cache_index_header *index, const char *name, bool insert) {
+    cache_slot *slots = get_slots(index);
+    uint64_t hash = hash_name(name);
+    cache_slot *free_slot = NULL;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        cache_slot *slot = &slots[(hash + i) % index->capacity];
+        if (slot->state == CACHE_SLOT_EMPTY) {
+            return insert ? (free_slot != NULL ? free_slot : slot) : NULL;
+        }
+        if (slot->state == CACHE_SLOT_DELETED) {
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+        } else if (slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+    return insert ? free_slot : NULL;
+}
+
+static void remove_slot(cache_index_header *index, cache_slot *slot) {
+    index->total_bytes -= slot->size;
+    index->num_entries--;
+    index->num_deleted++;
+    slot->state = CACHE_SLOT_DELETED;
+}
+
+// rewrites the index without deleted slots and with room for at least
+// min_entries entries at a load of at most one half
+static int rebuild_index(cache *c, uint32_t min_entries) {
+    uint32_t capacity = CACHE_INITIAL_CAPACITY;
+    while (capacity / 2 < min_entries) {
+        capacity *= 2;
+    }
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, CACHE_INDEX_FILENAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t size = get_index_size(capacity);
+    void *map = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp_path);
+        return -1;
+    }
+    cache_index_header *index = (cache_index_header *)map;
+    *index = *c->index;
+    index->capacity = capacity;
+    index->num_deleted = 0;
+    cache_slot *old_slots = get_slots(c->index);
+    cache_slot *new_slots = get_slots(index);
+    for (uint32_t i = 0; i < c->index->capacity; i++) {
+        if (old_slots[i].state == CACHE_SLOT_USED) {
+            uint32_t j = old_slots[i].hash % capacity;
+            while (new_slots[j].state != CACHE_SLOT_EMPTY) {
+                j = (j + 1) % capacity;
+            }
+            new_slots[j] = old_slots[i];
+        }
+    }
+    if (rename(tmp_path, path) != 0) {
+        munmap(map, size);
+        unlink(tmp_path);
+        return -1;
+    }
+    unmap_index(c);
+    c->index = index;
+    c->index_size = size;
+    return 0;
+}
+
+// returns true if a program has the file open (libvdi.so holds a shared
+// flock on each descriptor of a downloaded file)
+static bool is_pinned(const char *path, int *fd_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *fd_out = -1;
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        *fd_out = -1;
+        return true;
+    }
+    *fd_out = fd;
+    return false;
+}
+
+// removes the file name (and its download lock) unless it is pinned
+static bool remove_file(const cache *c, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, name);
+    char lock_path[PATH_MAX + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock_fd;
+    if (is_pinned(lock_path, &lock_fd)) {
+        // a process holds the download lease
+        return false;
+    }
+    int fd;
+    if (is_pinned(path, &fd)) {
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        return false;
+    }
+    unlink(path);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (lock_fd != -1) {
+        unlink(lock_path);
+        close(lock_fd);
+    }
+    return true;
+}
+
+// eviction order of libvdi.so: files that were never reused before files that
+// were, each group least recently used first
+static int compare_slots(const void *a, const void *b) {
+    const cache_slot *x = *(cache_slot *const *)a;
+    const cache_slot *y = *(cache_slot *const *)b;
+    if ((x->hits > 0) != (y->hits > 0)) {
+        return x->hits > 0 ? 1 : -1;
+    }
+    return x->last_access < y->last_access ? -1 : x->last_access > y->last_access;
+}
+
+static cache_slot **get_sorted_slots(cache_index_header *index, uint32_t *num_slots) {
+    cache_slot **sorted = (cache_slot **)malloc((index->num_entries + 1) * sizeof(cache_slot *));
+    cache_slot *slots = get_slots(index);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < index->capacity && n < index->num_entries; i++) {
+        if (slots[i].state == CACHE_SLOT_USED) {
+            sorted[n++] = &slots[i];
+        }
+    }
+    qsort(sorted, n, sizeof(cache_slot *), compare_slots);
+    *num_slots = n;
+    return sorted;
+}
+
+// evicts files in eviction order until the cache fits into budget (or all
+// files if budget is 0 and evict_all is set)
+static void evict(cache *c, long long budget, bool evict_all, long long *num_evicted, long long *evicted_bytes) {
+    uint32_t num_slots;
+    cache_slot **sorted = get_sorted_slots(c->index, &num_slots);
+    for (uint32_t i = 0; i < num_slots; i++) {
+        if (!evict_all && (budget <= 0 || c->index->total_bytes <= (uint64_t)budget)) {
+            break;
+        }
+        cache_slot *slot = sorted[i];
+        if (remove_file(c, slot->name)) {
+            (*num_evicted)++;
+            *evicted_bytes += slot->size;
+            c->index->evictions++;
+            c->index->evicted_bytes += slot->size;
+            remove_slot(c->index, slot);
+        }
+    }
+    free(sorted);
+}
+
+static bool is_cache_file(const char *name) {
+    return strncmp(name, ".vdi_cache.", strlen(".vdi_cache.")) == 0;
+}
+
+static bool has_suffix(const char *name, const char *suffix) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// brings the index in line with the directory: drops entries of removed files,
+// adopts files that are not in the index (downloaded before the index existed)
+// and removes stale temporary and lock files
+static void sync_index(cache *c, long long *num_adopted, long long *num_dropped, long long *num_stale) {
+    cache_slot *slots = get_slots(c->index);
+    char path[PATH_MAX];
+    struct stat st;
+    for (uint32_t i = 0; i < c->index->capacity; i++) {
+        cache_slot *slot = &slots[i];
+        if (slot->state != CACHE_SLOT_USED) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", c->dir, slot->name);
+        if (stat(path, &st) != 0) {
+            remove_slot(c->index, slot);
+            (*num_dropped)++;
+        } else if ((uint64_t)st.st_size != slot->size) {
+            c->index->total_bytes += st.st_size - slot->size;
+            slot->size = st.st_size;
+        }
+    }
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (is_cache_file(name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", c->dir, name);
+        if (has_suffix(name, ".lock")) {
+            // download leases are removed by their holder, a lock file nobody
+            // holds was left behind (by a crash or an older version)
+            int fd = open(path, O_RDWR | O_CLOEXEC);
+            if (fd != -1) {
+                if (flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(path) == 0) {
+                    (*num_stale)++;
+                }
+                close(fd);
+            }
+            continue;
+        }
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strstr(name, ".tmp.") != NULL) {
+            if (now - st.st_mtime > STALE_TMP_SECONDS && unlink(path) == 0) {
+                (*num_stale)++;
+            }
+            continue;
+        }
+        if (find_slot(c->index, name, false) != NULL) {
+            continue;
+        }
+        if ((c->index->num_entries + c->index->num_deleted + 1) * 4 > c->index->capacity * 3 &&
+            rebuild_index(c, c->index->num_entries + 1) != 0) {
+            break;
+        }
+        cache_slot *slot = find_slot(c->index, name, true);
+        if (slot->state == CACHE_SLOT_DELETED) {
+            c->index->num_deleted--;
+        }
+        memset(slot, 0, sizeof(cache_slot));
+        slot->state = CACHE_SLOT_USED;
+        slot->hash = hash_name(name);
+        snprintf(slot->name, sizeof(slot->name), "%s", name);
+        slot->size = st.st_size;
+        slot->last_access = st.st_mtime;
+        c->index->num_entries++;
+        c->index->total_bytes += st.st_size;
+        (*num_adopted)++;
+    }
+    closedir(dir);
+}
+
+static void print_time(FILE *out, int64_t seconds) {
+    time_t t = (time_t)seconds;
+    struct tm tm;
+    char buffer[32];
+    localtime_r(&t, &tm);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s", buffer);
+}
+
+static void print_stats(cache *c, long long budget, bool list) {
+    cache_index_header *index = c->index;
+    char buffer[2][32];
+    uint32_t num_slots;
+    cache_slot **sorted = get_sorted_slots(index, &num_slots);
+    long long num_pinned = 0;
+    long long pinned_bytes = 0;
+    bool *pinned = (bool *)calloc(num_slots + 1, sizeof(bool));
+    char path[PATH_MAX];
+    for (uint32_t i = 0; i < num_slots; i++) {
+        int fd;
+        snprintf(path, sizeof(path), "%s/%s", c->dir, sorted[i]->name);
+        pinned[i] = is_pinned(path, &fd);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (pinned[i]) {
+            num_pinned++;
+            pinned_bytes += sorted[i]->size;
+        }
+    }
+    printf("directory:  %s\n", c->dir);
+    if (budget > 0) {
+        printf("budget:     %s (%lld bytes)\n", format_bytes(budget, buffer[0], sizeof(buffer[0])), budget);
+        printf("used:       %s in %u files (%.1f%% of the budget)\n",
+               format_bytes(index->total_bytes, buffer[0], sizeof(buffer[0])), index->num_entries,
+               100.0 * index->total_bytes / budget);
+    } else {
+        printf("budget:     unlimited\n");
+        printf("used:       %s in %u files\n", format_bytes(index->total_bytes, buffer[0], sizeof(buffer[0])),
+               index->num_entries);
+    }
+    printf("pinned:     %s in %lld files (open)\n", format_bytes(pinned_bytes, buffer[0], sizeof(buffer[0])), num_pinned);
+    uint64_t uses = index->hits + index->downloads;
+    printf("downloads:  %llu\n", (unsigned long long)index->downloads);
+    printf("hits:       %llu (%.1f%% of the uses)\n", (unsigned long long)index->hits,
+           uses > 0 ? 100.0 * index->hits / uses : 0.0);
+    printf("evictions:  %llu (%s)\n", (unsigned long long)index->evictions,
+           format_bytes(index->evicted_bytes, buffer[1], sizeof(buffer[1])));
+    if (list) {
+        printf("\nfiles in eviction order:\n");
+        printf("%-19s  %10s  %6s  %-6s  %s\n", "last access", "size", "hits", "pinned", "name");
+        for (uint32_t i = 0; i < num_slots; i++) {
+            print_time(stdout, sorted[i]->last_access);
+            printf("  %10s  %6u  %-6s  %s\n", format_bytes(sorted[i]->size, buffer[0], sizeof(buffer[0])),
+                   sorted[i]->hits, pinned[i] ? "yes" : "no", sorted[i]->name);
+        }
+    }
+    free(pinned);
+    free(sorted);
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi cache [OPTIONS] stats|gc|clear\n");
+    fprintf(out, "Shows and maintains the files that libvdi.so downloaded for URLs and vdi:// paths.\n\n");
+    fprintf(out, "Commands:\n");
+    fprintf(out, "  stats                show the usage, hits and evictions of the cache\n");
+    fprintf(out, "  gc                   update the index from the directory (adopting files it\n");
+    fprintf(out, "                       does not know), remove temporary files of interrupted\n");
+    fprintf(out, "                       downloads and evict files until the cache fits the budget\n");
+    fprintf(out, "  clear                remove all files that are not open\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --dir DIR            download directory (default: $VDI_DOWNLOAD_BASE or\n");
+    fprintf(out, "                       /tmp/$USER/vdi/downloads)\n");
+    fprintf(out, "  --max-bytes SIZE     budget such as '20G', '25%%' of the file system or 'none'\n");
+    fprintf(out, "                       (default: $%s or '%s')\n", CACHE_ENVVAR_MAX_BYTES, CACHE_MAX_BYTES_DEFAULT);
+    fprintf(out, "  -l, --list           stats: also list the files in eviction order\n");
+    fprintf(out, "  -h, --help           show this help\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"dir", required_argument, NULL, 'd'},
+        {"max-bytes", required_argument, NULL, 'm'},
+        {"list", no_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    char *dir = NULL;
+    const char *max_bytes = getenv(CACHE_ENVVAR_MAX_BYTES);
+    bool list = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "lh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': free(dir); dir = strdup(optarg); break;
+            case 'm': max_bytes = optarg; break;
+            case 'l': list = true; break;
+            case 'h': usage(stdout); free(dir); return EXIT_SUCCESS;
+            default: usage(stderr); free(dir); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || (strcmp(argv[optind], "stats") != 0 && strcmp(argv[optind], "gc") != 0 &&
+                               strcmp(argv[optind], "clear") != 0)) {
+        usage(stderr);
+        free(dir);
+        return EXIT_FAILURE;
+    }
+    const char *command = argv[optind];
+    if (dir == NULL) {
+        dir = get_default_download_dir();
+    }
+    if (max_bytes == NULL || max_bytes[0] == '\0') {
+        max_bytes = CACHE_MAX_BYTES_DEFAULT;
+    }
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        if (strcmp(command, "stats") == 0) {
+            printf("directory:  %s (does not exist, nothing downloaded yet)\n", dir);
+            free(dir);
+            return EXIT_SUCCESS;
+        }
+        fprintf(stderr, "vdi-cache: '%s' is not a directory\n", dir);
+        free(dir);
+        return EXIT_FAILURE;
+    }
+    long long budget = get_budget(max_bytes, dir);
+
+    cache c;
+    if (open_cache(&c, dir) != 0) {
+        free(dir);
+        return EXIT_FAILURE;
+    }
+    char buffer[2][32];
+    if (strcmp(command, "stats") == 0) {
+        print_stats(&c, budget, list);
+    } else if (strcmp(command, "gc") == 0) {
+        long long num_adopted = 0, num_dropped = 0, num_stale = 0, num_evicted = 0, evicted_bytes = 0;
+        sync_index(&c, &num_adopted, &num_dropped, &num_stale);
+        if (c.index->num_deleted > 0) {
+            rebuild_index(&c, c.index->num_entries);
+        }
+        evict(&c, budget, false, &num_evicted, &evicted_bytes);
+        printf("adopted %lld files, dropped %lld missing files, removed %lld stale temporary and lock files\n",
+               num_adopted, num_dropped, num_stale);
+        printf("evicted %lld files (%s), %s in %u files remain\n", num_evicted,
+               format_bytes(evicted_bytes, buffer[0], sizeof(buffer[0])),
+               format_bytes(c.index->total_bytes, buffer[1], sizeof(buffer[1])), c.index->num_entries);
+    } else {
+        long long num_adopted = 0, num_dropped = 0, num_stale = 0, num_evicted = 0, evicted_bytes = 0;
+        sync_index(&c, &num_adopted, &num_dropped, &num_stale);
+        evict(&c, 0, true, &num_evicted, &evicted_bytes);
+        printf("removed %lld files (%s)", num_evicted, format_bytes(evicted_bytes, buffer[0], sizeof(buffer[0])));
+        if (c.index->num_entries > 0) {
+            printf(", %u files are open and were kept", c.index->num_entries);
+        }
+        printf("\n");
+    }
+    close_cache(&c);
+    free(dir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+#include <errno.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace cat [LOG_FILE|LOG_DIR ...]\n");
+    fprintf(out, "Prints log files written by libvdi.so, compressed logs (VDI_LOG_COMPRESS) are\n");
+    fprintf(out, "decompressed. Directories contribute their log files. Without arguments the\n");
+    fprintf(out, "log directory ($VDI_LOG_DIR or $HOME/.vdi/logs) is used.\n");
+}
+
+int cat_main(int argc, char **argv) {
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        usage(stdout);
+        return EXIT_SUCCESS;
+    }
+    char **paths;
+    int num_paths = collect_log_files(argc - 1, argv + 1, &paths);
+    if (num_paths < 0) {
+        return EXIT_FAILURE;
+    }
+    int ret = EXIT_SUCCESS;
+    for (int i = 0; i < num_paths; i++) {
+        log_file file;
+        if (log_file_open(paths[i], &file) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+            ret = EXIT_FAILURE;
+        } else {
+            if (decompress_log_file(&file) != 0) {
+                ret = EXIT_FAILURE;
+            } else if (file.size > 0 && fwrite(file.data, 1, file.size, stdout) != file.size) {
+                ret = EXIT_FAILURE;
+            }
+            log_file_close(&file);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    return ret;
+}
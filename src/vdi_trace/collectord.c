@@ -0,0 +1,407 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// vdi-collectord: node-local collector of the log lines of libvdi.so
+//
+// Instead of every traced process creating and appending to its own log file,
+// libvdi.so sends its log lines as datagrams to the Unix socket of this
+// daemon (see COLLECTOR_MAGIC in trace.h). The daemon buffers the lines per
+// session and appends them in large batches (optionally as compressed frames)
+// to one file per node and session, LOG_DIR/vdi_log.HOST.SESSION.log. If no
+// daemon is running, libvdi.so writes its per-process files as before.
+
+#define DEFAULT_BATCH_SIZE (1024 * 1024)
+#define DEFAULT_FLUSH_INTERVAL_MS 1000
+#define IDLE_SESSION_SECONDS 60
+#define RECEIVE_BUFFER_SIZE (8 * 1024 * 1024)
+#define MAX_DATAGRAM_SIZE (256 * 1024)
+
+typedef struct {
+    int fd;            // log file or -1 if not open
+    char *buffer;      // lines not yet written
+    size_t size;
+    size_t capacity;
+    time_t last_data;
+} session;
+
+typedef struct {
+    const char *log_dir;
+    char host[256];
+    compressor compressor;
+    size_t batch_size;
+    strmap *sessions;  // session id -> session
+    long long datagrams;
+    long long bytes;
+    long long rejected;
+} collector;
+
+static volatile sig_atomic_t _stop = 0;
+
+static void handle_signal(int signal) {
+    (void)signal;
+    _stop = 1;
+}
+
+static int open_session_file(collector *c, const char *id, size_t len) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/vdi_log.%s.%.*s.log%s", c->log_dir, c->host, (int)len, id,
+             get_compression_suffix(&c->compressor));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd == -1) {
+        fprintf(stderr, "vdi-collectord: cannot open '%s': %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+static void write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "vdi-collectord: write failed: %s\n", strerror(errno));
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+// appends the buffered lines of a session to its file
+static void flush_session(collector *c, const char *id, size_t len, session *s) {
+    if (s->size == 0) {
+        return;
+    }
+    if (s->fd == -1) {
+        s->fd = open_session_file(c, id, len);
+    }
+    if (s->fd != -1) {
+        if (c->compressor.compression == LOG_COMPRESSION_NONE) {
+            write_all(s->fd, s->buffer, s->size);
+        } else {
+            size_t frame_size;
+            char *frame = compress_frame(&c->compressor, s->buffer, s->size, &frame_size);
+            if (frame == NULL) {
+                fprintf(stderr, "vdi-collectord: compressing %zu bytes failed\n", s->size);
+            } else {
+                write_all(s->fd, frame, frame_size);
+                free(frame);
+            }
+        }
+    }
+    s->size = 0;
+}
+
+// flushes all sessions and closes the files of idle sessions
+static void flush_sessions(collector *c, bool close_all) {
+    time_t now = time(NULL);
+    const char *id;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(c->sessions); i++) {
+        session *s = (session *)strmap_slot(c->sessions, i, &id, &len);
+        if (s == NULL) {
+            continue;
+        }
+        flush_session(c, id, len, s);
+        if (s->fd != -1 && (close_all || now - s->last_data > IDLE_SESSION_SECONDS)) {
+            close(s->fd);
+            s->fd = -1;
+            free(s->buffer);
+            s->buffer = NULL;
+            s->capacity = 0;
+        }
+    }
+}
+
+// the session id becomes part of a file name
+static bool is_valid_session_id(const char *id, size_t len) {
+    if (len == 0 || (len == 1 && id[0] == '.') || (len == 2 && id[0] == '.' && id[1] == '.')) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (id[i] == '/' || (unsigned char)id[i] < 0x20) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void handle_datagram(collector *c, const char *data, size_t size) {
+    if (size < COLLECTOR_MAGIC_LEN || memcmp(data, COLLECTOR_MAGIC, COLLECTOR_MAGIC_LEN) != 0) {
+        c->rejected++;
+        return;
+    }
+    const char *id = data + COLLECTOR_MAGIC_LEN;
+    size_t max_len = size - COLLECTOR_MAGIC_LEN;
+    if (max_len > COLLECTOR_MAX_SESSION_LEN + 1) {
+        max_len = COLLECTOR_MAX_SESSION_LEN + 1;
+    }
+    const char *end = memchr(id, '\0', max_len);
+    if (end == NULL || !is_valid_session_id(id, end - id)) {
+        c->rejected++;
+        return;
+    }
+    const char *lines = end + 1;
+    size_t lines_size = data + size - lines;
+    if (lines_size == 0) {
+        return;
+    }
+    session *s = (session *)strmap_find(c->sessions, id, end - id);
+    if (s == NULL) {
+        s = (session *)strmap_insert(c->sessions, id, end - id);
+        s->fd = -1;
+    }
+    if (s->size + lines_size > s->capacity) {
+        size_t capacity = s->capacity == 0 ? c->batch_size + MAX_DATAGRAM_SIZE : s->capacity;
+        while (capacity < s->size + lines_size) {
+            capacity *= 2;
+        }
+        s->buffer = (char *)realloc(s->buffer, capacity);
+        s->capacity = capacity;
+    }
+    memcpy(s->buffer + s->size, lines, lines_size);
+    s->size += lines_size;
+    s->last_data = time(NULL);
+    c->datagrams++;
+    c->bytes += lines_size;
+    if (s->size >= c->batch_size) {
+        flush_session(c, id, end - id, s);
+    }
+}
+
+// binds the socket, refusing to replace the socket of a running daemon
+static int bind_socket(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "vdi-collectord: socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "vdi-collectord: cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "vdi-collectord: another daemon is listening on '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    mode_t old_umask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (ret != 0) {
+        fprintf(stderr, "vdi-collectord: cannot bind socket '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int size = RECEIVE_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+}
+
+// detaches from the terminal; the parent prints the pid of the daemon and exits
+static int daemonize(const char *socket_path) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "vdi-collectord: cannot fork: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        printf("vdi-collectord: listening on '%s' (pid %d)\n", socket_path, (int)pid);
+        exit(EXIT_SUCCESS);
+    }
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) {
+            close(null_fd);
+        }
+    }
+    return 0;
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi collectord [OPTIONS]\n");
+    fprintf(out, "Collects the log lines of all processes run with libvdi.so on this node and\n");
+    fprintf(out, "writes them in batches to one file per session (VDI_SESSION_ID),\n");
+    fprintf(out, "LOG_DIR/vdi_log.HOST.SESSION.log. Stop it with SIGTERM or SIGINT.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --socket PATH        socket to listen on (default: $%s or\n", COLLECTOR_ENVVAR_SOCKET);
+    fprintf(out, "                       " COLLECTOR_SOCKET_TEMPLATE ")\n", "$USER");
+    fprintf(out, "  --log-dir DIR        directory of the log files (default: $VDI_LOG_DIR or\n");
+    fprintf(out, "                       $HOME/.vdi/logs)\n");
+    fprintf(out, "  --compress CODEC     'none', 'zstd[:LEVEL]' or 'lz4[:LEVEL]' (default:\n");
+    fprintf(out, "                       $VDI_LOG_COMPRESS or 'none')\n");
+    fprintf(out, "  --batch-size BYTES   write a session once it buffers this many bytes\n");
+    fprintf(out, "                       (default: %d)\n", DEFAULT_BATCH_SIZE);
+    fprintf(out, "  --flush-interval MS  write buffered lines at least this often (default: %d)\n",
+            DEFAULT_FLUSH_INTERVAL_MS);
+    fprintf(out, "  -d, --daemon         run in the background\n");
+    fprintf(out, "  -h, --help           show this help\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"log-dir", required_argument, NULL, 'l'},
+        {"compress", required_argument, NULL, 'c'},
+        {"batch-size", required_argument, NULL, 'b'},
+        {"flush-interval", required_argument, NULL, 'f'},
+        {"daemon", no_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    char socket_path[sizeof(((struct sockaddr_un *)NULL)->sun_path) + 1] = "";
+    char *log_dir = NULL;
+    const char *compress = getenv("VDI_LOG_COMPRESS");
+    long long batch_size = DEFAULT_BATCH_SIZE;
+    int flush_interval = DEFAULT_FLUSH_INTERVAL_MS;
+    bool daemon = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's': snprintf(socket_path, sizeof(socket_path), "%s", optarg); break;
+            case 'l': free(log_dir); log_dir = strdup(optarg); break;
+            case 'c': compress = optarg; break;
+            case 'b': batch_size = atoll(optarg); break;
+            case 'f': flush_interval = atoi(optarg); break;
+            case 'd': daemon = true; break;
+            case 'h': usage(stdout); return EXIT_SUCCESS;
+            default: usage(stderr); return EXIT_FAILURE;
+        }
+    }
+    if (socket_path[0] == '\0') {
+        const char *value = getenv(COLLECTOR_ENVVAR_SOCKET);
+        const char *user = getenv("USER");
+        if (value != NULL && value[0] != '\0') {
+            snprintf(socket_path, sizeof(socket_path), "%s", value);
+        } else {
+            snprintf(socket_path, sizeof(socket_path), COLLECTOR_SOCKET_TEMPLATE, user == NULL ? "unknown" : user);
+        }
+    }
+    if (log_dir == NULL) {
+        log_dir = get_default_log_dir();
+    }
+    if (batch_size <= 0 || flush_interval <= 0) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    collector c;
+    memset(&c, 0, sizeof(c));
+    c.log_dir = log_dir;
+    c.batch_size = batch_size;
+    if (init_compressor(compress, &c.compressor) != 0) {
+        fprintf(stderr, "vdi-collectord: cannot use compression '%s'\n", compress);
+        return EXIT_FAILURE;
+    }
+    if (gethostname(c.host, sizeof(c.host)) != 0) {
+        snprintf(c.host, sizeof(c.host), "unknown");
+    }
+    char *dot = strchr(c.host, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+    }
+    if (mkdir(log_dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "vdi-collectord: cannot create log directory '%s': %s\n", log_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int fd = bind_socket(socket_path);
+    if (fd == -1) {
+        return EXIT_FAILURE;
+    }
+    if (daemon && daemonize(socket_path) != 0) {
+        unlink(socket_path);
+        return EXIT_FAILURE;
+    }
+    if (!daemon) {
+        fprintf(stderr, "vdi-collectord: listening on '%s', writing to '%s'\n", socket_path, log_dir);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+
+    c.sessions = strmap_create(sizeof(session));
+    char *datagram = (char *)malloc(MAX_DATAGRAM_SIZE);
+    struct timespec last_flush;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    while (!_stop) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - last_flush.tv_sec) * 1000 + (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+        if (elapsed >= flush_interval) {
+            flush_sessions(&c, false);
+            last_flush = now;
+            elapsed = 0;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, flush_interval - elapsed);
+        if (ready == -1 && errno != EINTR) {
+            fprintf(stderr, "vdi-collectord: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        // drain the socket before waiting again
+        while (true) {
+            ssize_t size = recv(fd, datagram, MAX_DATAGRAM_SIZE, MSG_DONTWAIT);
+            if (size < 0) {
+                break;
+            }
+            handle_datagram(&c, datagram, size);
+        }
+    }
+
+    // new processes cannot connect anymore, processes that are connected fall
+    // back to their own files once the socket is closed
+    unlink(socket_path);
+    ssize_t size;
+    while ((size = recv(fd, datagram, MAX_DATAGRAM_SIZE, MSG_DONTWAIT)) >= 0) {
+        handle_datagram(&c, datagram, size);
+    }
+    close(fd);
+    flush_sessions(&c, true);
+    if (!daemon) {
+        fprintf(stderr, "vdi-collectord: received %lld datagrams with %lld bytes (%lld rejected) in %zu session(s)\n",
+                c.datagrams, c.bytes, c.rejected, strmap_size(c.sessions));
+    }
+
+    const char *id;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(c.sessions); i++) {
+        session *s = (session *)strmap_slot(c.sessions, i, &id, &len);
+        if (s != NULL) {
+            free(s->buffer);
+        }
+    }
+    strmap_free(c.sessions);
+    free(datagram);
+    free(log_dir);
+    return EXIT_SUCCESS;
+}
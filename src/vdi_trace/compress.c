@@ -0,0 +1,118 @@
+#include <dlfcn.h>
+#include <string.h>
+
+#include "trace.h"
+
+// compression of the logs written by vdi-collectord, producing the same
+// independent zstd or LZ4 frames as libvdi.so with VDI_LOG_COMPRESS; the
+// codec libraries are loaded with dlopen as in decompress.c
+
+// mirrors LZ4F_preferences_t of lz4frame.h (stable ABI since lz4 1.8)
+typedef struct {
+    unsigned block_size_id;
+    unsigned block_mode;
+    unsigned content_checksum_flag;
+    unsigned frame_type;
+    unsigned long long content_size;
+    unsigned dict_id;
+    unsigned block_checksum_flag;
+    int compression_level;
+    unsigned auto_flush;
+    unsigned favor_dec_speed;
+    unsigned reserved[3];
+} lz4f_preferences;
+
+static struct {
+    size_t (*compress_bound)(size_t);
+    size_t (*compress)(void *, size_t, const void *, size_t, int);
+    unsigned (*is_error)(size_t);
+} zstd;
+
+static struct {
+    size_t (*compress_frame_bound)(size_t, const lz4f_preferences *);
+    size_t (*compress_frame)(void *, size_t, const void *, size_t, const lz4f_preferences *);
+    unsigned (*is_error)(size_t);
+} lz4;
+
+// parses 'none', 'zstd[:LEVEL]' or 'lz4[:LEVEL]' (the format of VDI_LOG_COMPRESS)
+// and loads the codec library
+// returns 0 on success or -1 if the codec is unknown or cannot be loaded
+int init_compressor(const char *spec, compressor *c) {
+    memset(c, 0, sizeof(compressor));
+    if (spec == NULL || spec[0] == '\0' || strcmp(spec, "none") == 0) {
+        return 0;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%s", spec);
+    char *separator = strchr(name, ':');
+    if (separator != NULL) {
+        *separator = '\0';
+        c->level = atoi(separator + 1);
+    }
+    if (strcmp(name, "zstd") == 0) {
+        void *handle = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (handle != NULL) {
+            *(void **)&zstd.compress_bound = dlsym(handle, "ZSTD_compressBound");
+            *(void **)&zstd.compress = dlsym(handle, "ZSTD_compress");
+            *(void **)&zstd.is_error = dlsym(handle, "ZSTD_isError");
+        }
+        if (zstd.compress_bound == NULL || zstd.compress == NULL || zstd.is_error == NULL) {
+            return -1;
+        }
+        c->compression = LOG_COMPRESSION_ZSTD;
+        if (c->level == 0) {
+            c->level = 3;
+        }
+    } else if (strcmp(name, "lz4") == 0) {
+        void *handle = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (handle != NULL) {
+            *(void **)&lz4.compress_frame_bound = dlsym(handle, "LZ4F_compressFrameBound");
+            *(void **)&lz4.compress_frame = dlsym(handle, "LZ4F_compressFrame");
+            *(void **)&lz4.is_error = dlsym(handle, "LZ4F_isError");
+        }
+        if (lz4.compress_frame_bound == NULL || lz4.compress_frame == NULL || lz4.is_error == NULL) {
+            return -1;
+        }
+        c->compression = LOG_COMPRESSION_LZ4;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// suffix appended to '.log' for files written with the compressor
+const char *get_compression_suffix(const compressor *c) {
+    switch (c->compression) {
+        case LOG_COMPRESSION_ZSTD: return ".zst";
+        case LOG_COMPRESSION_LZ4: return ".lz4";
+        default: return "";
+    }
+}
+
+// compresses data into one frame
+// returns the frame (to be freed by the caller) or NULL on failure
+char *compress_frame(const compressor *c, const char *data, size_t size, size_t *frame_size) {
+    char *frame = NULL;
+    if (c->compression == LOG_COMPRESSION_ZSTD) {
+        size_t capacity = zstd.compress_bound(size);
+        frame = (char *)malloc(capacity);
+        *frame_size = zstd.compress(frame, capacity, data, size, c->level);
+        if (zstd.is_error(*frame_size)) {
+            free(frame);
+            return NULL;
+        }
+    } else if (c->compression == LOG_COMPRESSION_LZ4) {
+        lz4f_preferences preferences;
+        memset(&preferences, 0, sizeof(preferences));
+        preferences.content_size = size;
+        preferences.compression_level = c->level;
+        size_t capacity = lz4.compress_frame_bound(size, &preferences);
+        frame = (char *)malloc(capacity);
+        *frame_size = lz4.compress_frame(frame, capacity, data, size, &preferences);
+        if (lz4.is_error(*frame_size)) {
+            free(frame);
+            return NULL;
+        }
+    }
+    return frame;
+}
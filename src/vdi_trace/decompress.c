@@ -0,0 +1,372 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+// logs written with VDI_LOG_COMPRESS consist of independent zstd or LZ4 frames;
+// the codec libraries are loaded with dlopen, so that vdi-trace does not
+// depend on them for uncompressed logs
+
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+static const unsigned char LZ4_MAGIC[] = {0x04, 0x22, 0x4d, 0x18};
+
+// mirror ZSTD_inBuffer/ZSTD_outBuffer of zstd.h
+typedef struct {
+    const void *src;
+    size_t size;
+    size_t pos;
+} zstd_in_buffer;
+
+typedef struct {
+    void *dst;
+    size_t size;
+    size_t pos;
+} zstd_out_buffer;
+
+static struct {
+    void *(*create_dstream)(void);
+    size_t (*init_dstream)(void *);
+    size_t (*decompress_stream)(void *, zstd_out_buffer *, zstd_in_buffer *);
+    size_t (*free_dstream)(void *);
+    unsigned (*is_error)(size_t);
+    const char *(*get_error_name)(size_t);
+} zstd;
+
+static struct {
+    size_t (*create_context)(void **, unsigned);
+    size_t (*decompress)(void *, void *, size_t *, const void *, size_t *, const void *);
+    size_t (*free_context)(void *);
+    unsigned (*is_error)(size_t);
+    const char *(*get_error_name)(size_t);
+} lz4;
+
+static bool _zstd_loaded = false;
+static bool _lz4_loaded = false;
+static pthread_once_t _codecs_once = PTHREAD_ONCE_INIT;
+
+static void load_codecs(void) {
+    void *handle = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (handle != NULL) {
+        *(void **)&zstd.create_dstream = dlsym(handle, "ZSTD_createDStream");
+        *(void **)&zstd.init_dstream = dlsym(handle, "ZSTD_initDStream");
+        *(void **)&zstd.decompress_stream = dlsym(handle, "ZSTD_decompressStream");
+        *(void **)&zstd.free_dstream = dlsym(handle, "ZSTD_freeDStream");
+        *(void **)&zstd.is_error = dlsym(handle, "ZSTD_isError");
+        *(void **)&zstd.get_error_name = dlsym(handle, "ZSTD_getErrorName");
+        _zstd_loaded = zstd.create_dstream != NULL && zstd.init_dstream != NULL &&
+                       zstd.decompress_stream != NULL && zstd.free_dstream != NULL &&
+                       zstd.is_error != NULL && zstd.get_error_name != NULL;
+    }
+    handle = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (handle != NULL) {
+        *(void **)&lz4.create_context = dlsym(handle, "LZ4F_createDecompressionContext");
+        *(void **)&lz4.decompress = dlsym(handle, "LZ4F_decompress");
+        *(void **)&lz4.free_context = dlsym(handle, "LZ4F_freeDecompressionContext");
+        *(void **)&lz4.is_error = dlsym(handle, "LZ4F_isError");
+        *(void **)&lz4.get_error_name = dlsym(handle, "LZ4F_getErrorName");
+        _lz4_loaded = lz4.create_context != NULL && lz4.decompress != NULL &&
+                      lz4.free_context != NULL && lz4.is_error != NULL && lz4.get_error_name != NULL;
+    }
+}
+
+log_compression get_log_compression(const char *data, size_t size) {
+    if (size >= 4 && memcmp(data, ZSTD_MAGIC, 4) == 0) {
+        return LOG_COMPRESSION_ZSTD;
+    }
+    if (size >= 4 && memcmp(data, LZ4_MAGIC, 4) == 0) {
+        return LOG_COMPRESSION_LZ4;
+    }
+    return LOG_COMPRESSION_NONE;
+}
+
+static void grow(char **buffer, size_t *capacity, size_t used) {
+    if (used == *capacity) {
+        *capacity *= 2;
+        *buffer = (char *)realloc(*buffer, *capacity);
+    }
+}
+
+static int decompress_zstd(log_file *file, char **out, size_t *out_size) {
+    void *stream = zstd.create_dstream();
+    zstd.init_dstream(stream);
+    size_t capacity = 8 * file->size + 4096;
+    char *buffer = (char *)malloc(capacity);
+    zstd_in_buffer in = {file->data, file->size, 0};
+    zstd_out_buffer out_buffer = {buffer, capacity, 0};
+    size_t ret = 0;
+    while (in.pos < in.size) {
+        ret = zstd.decompress_stream(stream, &out_buffer, &in);
+        if (zstd.is_error(ret)) {
+            fprintf(stderr, "vdi-trace: '%s': %s after %zu of %zu bytes\n", file->path,
+                    zstd.get_error_name(ret), in.pos, in.size);
+            break;
+        }
+        if (out_buffer.pos == out_buffer.size) {
+            grow(&buffer, &capacity, out_buffer.pos);
+            out_buffer.dst = buffer;
+            out_buffer.size = capacity;
+        }
+    }
+    // flush output that is still held by the stream
+    while (!zstd.is_error(ret) && ret != 0 && out_buffer.pos == out_buffer.size) {
+        grow(&buffer, &capacity, out_buffer.pos);
+        out_buffer.dst = buffer;
+        out_buffer.size = capacity;
+        ret = zstd.decompress_stream(stream, &out_buffer, &in);
+    }
+    if (!zstd.is_error(ret) && ret != 0) {
+        // the last frame is incomplete, e.g., the program crashed while writing it
+        fprintf(stderr, "vdi-trace: '%s': last frame is truncated\n", file->path);
+    }
+    zstd.free_dstream(stream);
+    *out = buffer;
+    *out_size = out_buffer.pos;
+    return 0;
+}
+
+static int decompress_lz4(log_file *file, char **out, size_t *out_size) {
+    void *context = NULL;
+    size_t ret = lz4.create_context(&context, 100);    // LZ4F_VERSION
+    if (lz4.is_error(ret)) {
+        return -1;
+    }
+    size_t capacity = 8 * file->size + 4096;
+    char *buffer = (char *)malloc(capacity);
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    ret = 0;
+    while (in_pos < file->size) {
+        size_t dst_size = capacity - out_pos;
+        size_t src_size = file->size - in_pos;
+        ret = lz4.decompress(context, buffer + out_pos, &dst_size, file->data + in_pos, &src_size, NULL);
+        if (lz4.is_error(ret)) {
+            fprintf(stderr, "vdi-trace: '%s': %s after %zu of %zu bytes\n", file->path,
+                    lz4.get_error_name(ret), in_pos, file->size);
+            break;
+        }
+        in_pos += src_size;
+        out_pos += dst_size;
+        grow(&buffer, &capacity, out_pos);
+    }
+    if (!lz4.is_error(ret) && ret != 0) {
+        fprintf(stderr, "vdi-trace: '%s': last frame is truncated\n", file->path);
+    }
+    lz4.free_context(context);
+    *out = buffer;
+    *out_size = out_pos;
+    return 0;
+}
+
+// replaces the data of a compressed log file with its decompressed content
+// returns 0 on success (also for uncompressed files) or -1
+int decompress_log_file(log_file *file) {
+    log_compression compression = get_log_compression(file->data, file->size);
+    if (compression == LOG_COMPRESSION_NONE) {
+        return 0;
+    }
+    pthread_once(&_codecs_once, load_codecs);
+    char *buffer = NULL;
+    size_t size = 0;
+    int ret = -1;
+    if (compression == LOG_COMPRESSION_ZSTD && _zstd_loaded) {
+        ret = decompress_zstd(file, &buffer, &size);
+    } else if (compression == LOG_COMPRESSION_LZ4 && _lz4_loaded) {
+        ret = decompress_lz4(file, &buffer, &size);
+    } else {
+        fprintf(stderr, "vdi-trace: '%s': cannot load %s to decompress the log\n", file->path,
+                compression == LOG_COMPRESSION_ZSTD ? "libzstd.so.1" : "liblz4.so.1");
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    // the mapping of the compressed data is not needed anymore
+    if (file->mapping != NULL) {
+        munmap(file->mapping, file->mapping_size);
+        file->mapping = NULL;
+    }
+    file->buffer = buffer;
+    file->data = buffer;
+    file->size = size;
+    return 0;
+}
+
+static void decompress_worker(void *state, const log_chunk *chunk) {
+    log_file *files = (log_file *)state;
+    log_file *file = &files[chunk->file_index];
+    if (decompress_log_file(file) != 0) {
+        file->data = NULL;
+        file->size = 0;
+    }
+}
+
+// decompresses the compressed files among files in parallel, files that cannot
+// be decompressed are left empty
+void decompress_log_files(log_file *files, int num_files, int num_threads) {
+    log_chunk *chunks = (log_chunk *)malloc((num_files + 1) * sizeof(log_chunk));
+    int num_chunks = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (get_log_compression(files[i].data, files[i].size) != LOG_COMPRESSION_NONE) {
+            chunks[num_chunks].file_index = i;
+            chunks[num_chunks].data = files[i].data;
+            chunks[num_chunks].size = files[i].size;
+            num_chunks++;
+        }
+    }
+    if (num_chunks > 0) {
+        if (num_threads > num_chunks) {
+            num_threads = num_chunks;
+        }
+        void **states = (void **)malloc(num_threads * sizeof(void *));
+        for (int t = 0; t < num_threads; t++) {
+            states[t] = files;
+        }
+        process_chunks_in_parallel(chunks, num_chunks, num_threads, decompress_worker, states);
+        free(states);
+    }
+    free(chunks);
+}
+
+// decompresses more data into the window of a reader; returns false when the
+// file is exhausted
+static bool refill_reader(log_reader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->window, reader->window + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->window_size) {
+        reader->window_size *= 2;
+        reader->window = (char *)realloc(reader->window, reader->window_size);
+    }
+    log_file *file = reader->file;
+    while (true) {
+        size_t produced = 0;
+        bool failed = false;
+        if (reader->compression == LOG_COMPRESSION_ZSTD) {
+            zstd_in_buffer in = {file->data, file->size, reader->in_pos};
+            zstd_out_buffer out = {reader->window, reader->window_size, reader->end};
+            size_t ret = zstd.decompress_stream(reader->context, &out, &in);
+            if (zstd.is_error(ret)) {
+                fprintf(stderr, "vdi-trace: '%s': %s after %zu of %zu bytes\n", file->path,
+                        zstd.get_error_name(ret), in.pos, in.size);
+                failed = true;
+            } else {
+                produced = out.pos - reader->end;
+                if (produced > 0 || in.pos > reader->in_pos) {
+                    // a call without progress returns the header size of the next frame
+                    reader->pending = ret;
+                }
+                reader->in_pos = in.pos;
+            }
+        } else {
+            size_t dst_size = reader->window_size - reader->end;
+            size_t src_size = file->size - reader->in_pos;
+            size_t ret = lz4.decompress(reader->context, reader->window + reader->end, &dst_size,
+                                        file->data + reader->in_pos, &src_size, NULL);
+            if (lz4.is_error(ret)) {
+                fprintf(stderr, "vdi-trace: '%s': %s after %zu of %zu bytes\n", file->path,
+                        lz4.get_error_name(ret), reader->in_pos, file->size);
+                failed = true;
+            } else {
+                produced = dst_size;
+                if (produced > 0 || src_size > 0) {
+                    reader->pending = ret;
+                }
+                reader->in_pos += src_size;
+            }
+        }
+        if (failed) {
+            reader->eof = true;
+            return false;
+        }
+        if (produced > 0) {
+            reader->end += produced;
+            return true;
+        }
+        if (reader->in_pos == file->size) {
+            if (reader->pending != 0) {
+                fprintf(stderr, "vdi-trace: '%s': last frame is truncated\n", file->path);
+            }
+            reader->eof = true;
+            return false;
+        }
+    }
+}
+
+// prepares reading the lines of an opened log file; compressed files are
+// decompressed on the fly through a small window instead of as a whole
+// returns 0 on success or -1
+int log_reader_open(log_file *file, log_reader *reader) {
+    memset(reader, 0, sizeof(log_reader));
+    reader->file = file;
+    reader->compression = get_log_compression(file->data, file->size);
+    if (reader->compression == LOG_COMPRESSION_NONE) {
+        return 0;
+    }
+    pthread_once(&_codecs_once, load_codecs);
+    if (reader->compression == LOG_COMPRESSION_ZSTD && _zstd_loaded) {
+        reader->context = zstd.create_dstream();
+        zstd.init_dstream(reader->context);
+    } else if (reader->compression == LOG_COMPRESSION_LZ4 && _lz4_loaded) {
+        if (lz4.is_error(lz4.create_context(&reader->context, 100))) {    // LZ4F_VERSION
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "vdi-trace: '%s': cannot load %s to decompress the log\n", file->path,
+                reader->compression == LOG_COMPRESSION_ZSTD ? "libzstd.so.1" : "liblz4.so.1");
+        return -1;
+    }
+    reader->window_size = LOG_READER_WINDOW_SIZE;
+    reader->window = (char *)malloc(reader->window_size);
+    return 0;
+}
+
+// returns the next line (without the newline, valid until the next call) or
+// NULL at the end of the file; a last line without newline is returned as well
+const char *log_reader_next(log_reader *reader, size_t *len) {
+    if (reader->compression == LOG_COMPRESSION_NONE) {
+        log_file *file = reader->file;
+        if (reader->start >= file->size) {
+            return NULL;
+        }
+        const char *line = file->data + reader->start;
+        const char *newline = memchr(line, '\n', file->size - reader->start);
+        *len = newline == NULL ? file->size - reader->start : (size_t)(newline - line);
+        reader->start += *len + 1;
+        return line;
+    }
+    size_t searched = reader->start;
+    while (true) {
+        const char *newline = memchr(reader->window + searched, '\n', reader->end - searched);
+        if (newline != NULL) {
+            const char *line = reader->window + reader->start;
+            *len = newline - line;
+            reader->start += *len + 1;
+            return line;
+        }
+        searched = reader->end - reader->start;
+        if (reader->eof || !refill_reader(reader)) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            const char *line = reader->window + reader->start;
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+    }
+}
+
+void log_reader_close(log_reader *reader) {
+    if (reader->context != NULL) {
+        if (reader->compression == LOG_COMPRESSION_ZSTD) {
+            zstd.free_dstream(reader->context);
+        } else {
+            lz4.free_context(reader->context);
+        }
+    }
+    free(reader->window);
+    memset(reader, 0, sizeof(log_reader));
+}
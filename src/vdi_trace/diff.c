@@ -0,0 +1,929 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define DEFAULT_TOP 20
+#define DEFAULT_OPEN_COST_US 100
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_KEY_LEN 8192
+// first line of a run summary written with --save
+#define RUN_SUMMARY_MAGIC "#vdi-trace-run 1"
+// exit status if the estimated slowdown exceeds --fail-over
+#define EXIT_REGRESSION 2
+
+// latencies are counted in buckets of about 12% width: the values 0..7 have
+// their own buckets, above that each power of two is split into 8 buckets
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_NUM_BUCKETS 512
+
+enum {
+    LATENCY_DOWNLOAD = 0,   // 'vdi_download ... ELAPSED_USEC'
+    LATENCY_FETCH_WAIT,     // 'vdi_fetch_wait URL PRIORITY WAITED_USEC'
+    LATENCY_PROCESS,        // last elapsed time logged by a process
+    NUM_LATENCIES
+};
+static const char *LATENCY_NAMES[] = {"download", "fetch_wait", "process"};
+
+typedef struct {
+    long long count;
+    long long sum;
+    long long max;
+    long long buckets[LATENCY_NUM_BUCKETS];
+} latency_histogram;
+
+typedef struct {
+    long long opens;
+    long long reads;
+    long long writes;
+    bool remote;
+} file_stats;
+
+typedef struct {
+    long long count;
+    long long failed;
+    long long bytes_received;
+    long long bytes_stored;
+    long long elapsed_us;
+} download_stats;
+
+typedef struct {
+    long long processes;
+    long long elapsed_us;   // sum of the last elapsed times of the processes
+} program_stats;
+
+typedef struct {
+    long long elapsed_us;
+} process_stats;
+
+// the I/O of one run, from its logs (one per thread, merged into thread 0) or
+// from a run summary
+typedef struct {
+    strmap *files;          // absolute path or URL -> file_stats
+    strmap *downloads;      // URL -> download_stats
+    strmap *processes;      // process key (see get_process_key) -> process_stats, logs only
+    strmap *programs;       // program -> program_stats
+    strmap *directories;    // directory -> file_stats, see get_directories
+    latency_histogram latencies[NUM_LATENCIES];
+    long long lines;
+    long long malformed;
+    int num_log_files;      // 0 for a run summary
+} run;
+
+static run *run_create(void) {
+    run *r = (run *)calloc(1, sizeof(run));
+    r->files = strmap_create(sizeof(file_stats));
+    r->downloads = strmap_create(sizeof(download_stats));
+    r->processes = strmap_create(sizeof(process_stats));
+    r->programs = strmap_create(sizeof(program_stats));
+    return r;
+}
+
+static void run_free(run *r) {
+    if (r == NULL) {
+        return;
+    }
+    strmap_free(r->files);
+    strmap_free(r->downloads);
+    strmap_free(r->processes);
+    strmap_free(r->programs);
+    if (r->directories != NULL) {
+        strmap_free(r->directories);
+    }
+    free(r);
+}
+
+static int get_latency_bucket(long long us) {
+    if (us < LATENCY_SUB_BUCKETS) {
+        return us < 0 ? 0 : (int)us;
+    }
+    int exponent = 63 - __builtin_clzll((unsigned long long)us);
+    int sub = (int)((us >> (exponent - 3)) & (LATENCY_SUB_BUCKETS - 1));
+    int bucket = (exponent - 2) * LATENCY_SUB_BUCKETS + sub;
+    return bucket < LATENCY_NUM_BUCKETS ? bucket : LATENCY_NUM_BUCKETS - 1;
+}
+
+// middle of the values counted in bucket
+static double get_bucket_value(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 2;
+    double width = ldexp(1.0, exponent - 3);
+    return (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) * width + width / 2;
+}
+
+static void add_latency(latency_histogram *h, long long us) {
+    if (us < 0) {
+        return;
+    }
+    h->count++;
+    h->sum += us;
+    h->buckets[get_latency_bucket(us)]++;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+static double get_percentile(const latency_histogram *h, double p) {
+    if (h->count == 0) {
+        return 0.0;
+    }
+    long long target = (long long)ceil(p / 100.0 * h->count);
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && h->buckets[i] > 0) {
+            double value = get_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+static double get_mean(const latency_histogram *h) {
+    return h->count > 0 ? (double)h->sum / h->count : 0.0;
+}
+
+static void add_record(run *r, const log_record *record) {
+    char process_key[MAX_KEY_LEN];
+    size_t process_key_len = get_process_key(record, process_key, sizeof(process_key));
+    process_stats *process = (process_stats *)strmap_insert(r->processes, process_key, process_key_len);
+    long long elapsed = field_to_ll(record->columns[COL_ELAPSED]);
+    if (elapsed > process->elapsed_us) {
+        process->elapsed_us = elapsed;
+    }
+
+    field func = record->columns[COL_FUNC];
+    if (field_equals(func, "vdi_download") && record->num_columns > COL_FIRST_ARG + 5) {
+        field url = record->columns[COL_FIRST_ARG];
+        download_stats *download = (download_stats *)strmap_insert(r->downloads, url.ptr, url.len);
+        download->count++;
+        if (!field_equals(record->columns[COL_FIRST_ARG + 5], "OK")) {
+            download->failed++;
+        }
+        download->bytes_received += field_to_ll(record->columns[COL_FIRST_ARG + 3]);
+        download->bytes_stored += field_to_ll(record->columns[COL_FIRST_ARG + 4]);
+        // logs of older versions of libvdi.so do not have the elapsed time
+        if (record->num_columns > COL_FIRST_ARG + 6) {
+            long long us = field_to_ll(record->columns[COL_FIRST_ARG + 6]);
+            download->elapsed_us += us;
+            add_latency(&r->latencies[LATENCY_DOWNLOAD], us);
+        }
+        return;
+    }
+    if (field_equals(func, "vdi_fetch_wait") && record->num_columns > COL_FIRST_ARG + 2) {
+        add_latency(&r->latencies[LATENCY_FETCH_WAIT], field_to_ll(record->columns[COL_FIRST_ARG + 2]));
+        return;
+    }
+
+    open_event event;
+    if (!parse_open_event(record, &event)) {
+        return;
+    }
+    char path[MAX_KEY_LEN];
+    size_t path_len;
+    if (event.remote || event.dirfd != AT_FDCWD) {
+        field no_cwd = {"", 0};
+        path_len = make_absolute_path(no_cwd, event.path, path, sizeof(path));
+    } else {
+        path_len = make_absolute_path(record->columns[COL_CWD], event.path, path, sizeof(path));
+    }
+    file_stats *file = (file_stats *)strmap_insert(r->files, path, path_len);
+    file->opens++;
+    if (event.access & ACCESS_READ) {
+        file->reads++;
+    }
+    if (event.access & ACCESS_WRITE) {
+        file->writes++;
+    }
+    file->remote |= event.remote;
+}
+
+// a log line starts with the time of the call (SECONDS.MICROSECONDS::DATE)
+// and has the pid in its column, other text (such as the output of
+// 'summarize --json') is not
+static bool is_log_record(const log_record *record) {
+    field time = record->columns[COL_TIME];
+    field pid = record->columns[COL_PID];
+    if (time.len == 0 || !isdigit((unsigned char)time.ptr[0]) || memmem(time.ptr, time.len, "::", 2) == NULL ||
+        pid.len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < pid.len; i++) {
+        if (!isdigit((unsigned char)pid.ptr[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void diff_chunk(void *state, const log_chunk *chunk) {
+    run *r = (run *)state;
+    const char *ptr = chunk->data;
+    const char *end = chunk->data + chunk->size;
+    log_record record;
+    while (ptr < end) {
+        const char *newline = memchr(ptr, '\n', end - ptr);
+        const char *line_end = newline == NULL ? end : newline;
+        size_t len = line_end - ptr;
+        if (len > 0) {
+            r->lines++;
+            if (split_record(ptr, len, &record) <= COL_FUNC || !is_log_record(&record)) {
+                r->malformed++;
+            } else {
+                add_record(r, &record);
+            }
+        }
+        ptr = line_end + 1;
+    }
+}
+
+static void merge_latencies(latency_histogram *into, const latency_histogram *from) {
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+static void merge_run(run *into, const run *from) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(from->files); i++) {
+        file_stats *value = (file_stats *)strmap_slot(from->files, i, &key, &len);
+        if (value != NULL) {
+            file_stats *entry = (file_stats *)strmap_insert(into->files, key, len);
+            entry->opens += value->opens;
+            entry->reads += value->reads;
+            entry->writes += value->writes;
+            entry->remote |= value->remote;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(from->downloads); i++) {
+        download_stats *value = (download_stats *)strmap_slot(from->downloads, i, &key, &len);
+        if (value != NULL) {
+            download_stats *entry = (download_stats *)strmap_insert(into->downloads, key, len);
+            entry->count += value->count;
+            entry->failed += value->failed;
+            entry->bytes_received += value->bytes_received;
+            entry->bytes_stored += value->bytes_stored;
+            entry->elapsed_us += value->elapsed_us;
+        }
+    }
+    // the lines of a process may be split across chunks
+    for (size_t i = 0; i < strmap_capacity(from->processes); i++) {
+        process_stats *value = (process_stats *)strmap_slot(from->processes, i, &key, &len);
+        if (value != NULL) {
+            process_stats *entry = (process_stats *)strmap_insert(into->processes, key, len);
+            if (value->elapsed_us > entry->elapsed_us) {
+                entry->elapsed_us = value->elapsed_us;
+            }
+        }
+    }
+    for (int i = 0; i < NUM_LATENCIES; i++) {
+        merge_latencies(&into->latencies[i], &from->latencies[i]);
+    }
+    into->lines += from->lines;
+    into->malformed += from->malformed;
+}
+
+// aggregates the processes per program (the last tab-separated field of the
+// process key) once all lines are merged
+static void count_processes_per_program(run *r) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(r->processes); i++) {
+        process_stats *value = (process_stats *)strmap_slot(r->processes, i, &key, &len);
+        if (value == NULL) {
+            continue;
+        }
+        const char *tab = memrchr(key, '\t', len);
+        const char *program = tab == NULL ? key : tab + 1;
+        program_stats *entry = (program_stats *)strmap_insert(r->programs, program, len - (program - key));
+        entry->processes++;
+        entry->elapsed_us += value->elapsed_us;
+        add_latency(&r->latencies[LATENCY_PROCESS], value->elapsed_us);
+    }
+}
+
+static run *read_logs(const char *arg, int threads) {
+    char **paths;
+    char *args[] = {(char *)arg};
+    int num_paths = collect_log_files(1, args, &paths);
+    if (num_paths < 0) {
+        return NULL;
+    }
+    log_file *files = (log_file *)calloc(num_paths + 1, sizeof(log_file));
+    int num_files = 0;
+    for (int i = 0; i < num_paths; i++) {
+        if (log_file_open(paths[i], &files[num_files]) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+            continue;
+        }
+        num_files++;
+    }
+    int num_threads = get_num_threads(threads);
+    decompress_log_files(files, num_files, num_threads);
+
+    log_chunk *chunks;
+    int num_chunks = split_into_chunks(files, num_files, CHUNK_SIZE, &chunks);
+    if (num_threads > num_chunks) {
+        num_threads = num_chunks > 0 ? num_chunks : 1;
+    }
+    run **states = (run **)malloc(num_threads * sizeof(run *));
+    for (int t = 0; t < num_threads; t++) {
+        states[t] = run_create();
+    }
+    process_chunks_in_parallel(chunks, num_chunks, num_threads, diff_chunk, (void **)states);
+    for (int t = 1; t < num_threads; t++) {
+        merge_run(states[0], states[t]);
+        run_free(states[t]);
+    }
+    run *r = states[0];
+    count_processes_per_program(r);
+    r->num_log_files = num_files;
+
+    free(states);
+    free(chunks);
+    for (int i = 0; i < num_files; i++) {
+        log_file_close(&files[i]);
+    }
+    free(files);
+    for (int i = 0; i < num_paths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    return r;
+}
+
+// a run summary has one tab-separated record per line, the key (which may
+// hold any character but a newline) comes last:
+//   lines LINES MALFORMED
+//   file OPENS READS WRITES REMOTE PATH
+//   download COUNT FAILED BYTES_RECEIVED BYTES_STORED ELAPSED_USEC URL
+//   program PROCESSES ELAPSED_USEC PROGRAM
+//   latency COUNT SUM MAX BUCKET:COUNT,... NAME
+static int save_run(const run *r, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "vdi-trace: cannot write '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(out, "%s\nlines\t%lld\t%lld\n", RUN_SUMMARY_MAGIC, r->lines, r->malformed);
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(r->files); i++) {
+        file_stats *f = (file_stats *)strmap_slot(r->files, i, &key, &len);
+        if (f != NULL) {
+            fprintf(out, "file\t%lld\t%lld\t%lld\t%d\t%.*s\n", f->opens, f->reads, f->writes, f->remote, (int)len, key);
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(r->downloads); i++) {
+        download_stats *d = (download_stats *)strmap_slot(r->downloads, i, &key, &len);
+        if (d != NULL) {
+            fprintf(out, "download\t%lld\t%lld\t%lld\t%lld\t%lld\t%.*s\n", d->count, d->failed, d->bytes_received,
+                    d->bytes_stored, d->elapsed_us, (int)len, key);
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(r->programs); i++) {
+        program_stats *p = (program_stats *)strmap_slot(r->programs, i, &key, &len);
+        if (p != NULL) {
+            fprintf(out, "program\t%lld\t%lld\t%.*s\n", p->processes, p->elapsed_us, (int)len, key);
+        }
+    }
+    for (int i = 0; i < NUM_LATENCIES; i++) {
+        const latency_histogram *h = &r->latencies[i];
+        fprintf(out, "latency\t%lld\t%lld\t%lld\t", h->count, h->sum, h->max);
+        int n = 0;
+        for (int b = 0; b < LATENCY_NUM_BUCKETS; b++) {
+            if (h->buckets[b] > 0) {
+                fprintf(out, "%s%d:%lld", n++ == 0 ? "" : ",", b, h->buckets[b]);
+            }
+        }
+        fprintf(out, "%s\t%s\n", n == 0 ? "-" : "", LATENCY_NAMES[i]);
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "vdi-trace: cannot write '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static bool is_run_summary(const char *path) {
+    char buffer[sizeof(RUN_SUMMARY_MAGIC)];
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return false;
+    }
+    size_t n = fread(buffer, 1, sizeof(buffer) - 1, in);
+    fclose(in);
+    return n == sizeof(buffer) - 1 && memcmp(buffer, RUN_SUMMARY_MAGIC, n) == 0;
+}
+
+// returns the key after the n-th tab of line (or NULL)
+static char *get_key_after_tabs(char *line, int n) {
+    for (int i = 0; i < n && line != NULL; i++) {
+        line = strchr(line, '\t');
+        line = line == NULL ? NULL : line + 1;
+    }
+    return line;
+}
+
+static run *read_run_summary(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    run *r = run_create();
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int line_number = 0;
+    bool ok = true;
+    while (ok && (len = getline(&line, &capacity, in)) != -1) {
+        line_number++;
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (line_number == 1 || len == 0) {
+            continue;
+        }
+        char *key;
+        if (strncmp(line, "lines\t", 6) == 0) {
+            ok = sscanf(line + 6, "%lld\t%lld", &r->lines, &r->malformed) == 2;
+        } else if (strncmp(line, "file\t", 5) == 0 && (key = get_key_after_tabs(line, 5)) != NULL) {
+            file_stats *f = (file_stats *)strmap_insert(r->files, key, strlen(key));
+            int remote = 0;
+            ok = sscanf(line + 5, "%lld\t%lld\t%lld\t%d", &f->opens, &f->reads, &f->writes, &remote) == 4;
+            f->remote = remote != 0;
+        } else if (strncmp(line, "download\t", 9) == 0 && (key = get_key_after_tabs(line, 6)) != NULL) {
+            download_stats *d = (download_stats *)strmap_insert(r->downloads, key, strlen(key));
+            ok = sscanf(line + 9, "%lld\t%lld\t%lld\t%lld\t%lld", &d->count, &d->failed, &d->bytes_received,
+                        &d->bytes_stored, &d->elapsed_us) == 5;
+        } else if (strncmp(line, "program\t", 8) == 0 && (key = get_key_after_tabs(line, 3)) != NULL) {
+            program_stats *p = (program_stats *)strmap_insert(r->programs, key, strlen(key));
+            ok = sscanf(line + 8, "%lld\t%lld", &p->processes, &p->elapsed_us) == 2;
+        } else if (strncmp(line, "latency\t", 8) == 0 && (key = get_key_after_tabs(line, 5)) != NULL) {
+            int i = 0;
+            while (i < NUM_LATENCIES && strcmp(key, LATENCY_NAMES[i]) != 0) {
+                i++;
+            }
+            if (i == NUM_LATENCIES) {
+                continue;   // written by a later version
+            }
+            latency_histogram *h = &r->latencies[i];
+            int offset = 0;
+            ok = sscanf(line + 8, "%lld\t%lld\t%lld\t%n", &h->count, &h->sum, &h->max, &offset) == 3 && offset > 0;
+            for (char *ptr = line + 8 + offset; ok && *ptr != '\t' && *ptr != '-'; ) {
+                int bucket;
+                long long count;
+                int n = 0;
+                ok = sscanf(ptr, "%d:%lld%n", &bucket, &count, &n) == 2 && bucket >= 0 && bucket < LATENCY_NUM_BUCKETS;
+                if (ok) {
+                    h->buckets[bucket] = count;
+                    ptr += n;
+                    ptr += *ptr == ',' ? 1 : 0;
+                }
+            }
+        }
+    }
+    free(line);
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "vdi-trace: malformed line %d in run summary '%s'\n", line_number, path);
+        run_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// aggregates the opens per directory (the path up to its last '/')
+static strmap *get_directories(const run *r) {
+    strmap *directories = strmap_create(sizeof(file_stats));
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(r->files); i++) {
+        file_stats *value = (file_stats *)strmap_slot(r->files, i, &key, &len);
+        const char *slash = value == NULL ? NULL : memrchr(key, '/', len);
+        if (slash == NULL) {
+            continue;
+        }
+        size_t dir_len = slash == key ? 1 : (size_t)(slash - key);
+        file_stats *entry = (file_stats *)strmap_insert(directories, key, dir_len);
+        entry->opens += value->opens;
+        entry->remote |= value->remote;
+    }
+    return directories;
+}
+
+static run *read_run(const char *arg, int threads) {
+    run *r = is_run_summary(arg) ? read_run_summary(arg) : read_logs(arg, threads);
+    if (r != NULL && r->num_log_files > 0 && r->lines == r->malformed) {
+        // e.g. the output of 'summarize', or a summary of another version
+        fprintf(stderr, "vdi-trace: '%s' is neither a log nor a run summary saved with --save\n", arg);
+        run_free(r);
+        return NULL;
+    }
+    if (r != NULL) {
+        r->directories = get_directories(r);
+    }
+    return r;
+}
+
+typedef struct {
+    long long processes;
+    long long opens;
+    long long remote_opens;
+    long long downloads;
+    long long failed_downloads;
+    long long bytes_received;
+    long long download_us;
+} run_totals;
+
+static run_totals get_totals(const run *r) {
+    run_totals t = {0, 0, 0, 0, 0, 0, 0};
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(r->files); i++) {
+        file_stats *f = (file_stats *)strmap_slot(r->files, i, &key, &len);
+        if (f != NULL) {
+            t.opens += f->opens;
+            t.remote_opens += f->remote ? f->opens : 0;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(r->downloads); i++) {
+        download_stats *d = (download_stats *)strmap_slot(r->downloads, i, &key, &len);
+        if (d != NULL) {
+            t.downloads += d->count;
+            t.failed_downloads += d->failed;
+            t.bytes_received += d->bytes_received;
+            t.download_us += d->elapsed_us;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(r->programs); i++) {
+        program_stats *p = (program_stats *)strmap_slot(r->programs, i, &key, &len);
+        if (p != NULL) {
+            t.processes += p->processes;
+        }
+    }
+    return t;
+}
+
+// a difference between the runs with its estimated effect on the time of run
+// B (positive: B is slower); the key points into the maps of the runs
+typedef struct {
+    const char *kind;
+    const char *key;
+    size_t len;
+    double a;
+    double b;
+    double impact_us;
+} change;
+
+typedef struct {
+    change *changes;
+    size_t num_changes;
+    size_t capacity;
+} change_list;
+
+static void add_change(change_list *list, const char *kind, const char *key, size_t len, double a, double b,
+                       double impact_us) {
+    if (list->num_changes == list->capacity) {
+        list->capacity = list->capacity == 0 ? 256 : 2 * list->capacity;
+        list->changes = (change *)realloc(list->changes, list->capacity * sizeof(change));
+    }
+    list->changes[list->num_changes++] = (change){kind, key, len, a, b, impact_us};
+}
+
+static int compare_changes(const void *a, const void *b) {
+    const change *x = (const change *)a;
+    const change *y = (const change *)b;
+    if (fabs(x->impact_us) != fabs(y->impact_us)) {
+        return fabs(x->impact_us) < fabs(y->impact_us) ? 1 : -1;
+    }
+    int result = strcmp(x->kind, y->kind);
+    if (result != 0) {
+        return result;
+    }
+    size_t len = x->len < y->len ? x->len : y->len;
+    result = memcmp(x->key, y->key, len);
+    return result != 0 ? result : (x->len > y->len) - (x->len < y->len);
+}
+
+// the estimated total counts each effect once: the opens (at open_cost_us
+// each), the time spent downloading and the time downloads waited for the
+// fetch limits
+typedef struct {
+    double opens_us;
+    double downloads_us;
+    double fetch_waits_us;
+} impact_totals;
+
+static void diff_files(const run *a, const run *b, double open_cost_us, change_list *list) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(a->files); i++) {
+        file_stats *fa = (file_stats *)strmap_slot(a->files, i, &key, &len);
+        if (fa != NULL && strmap_find(b->files, key, len) == NULL) {
+            add_change(list, "file_removed", key, len, fa->opens, 0, -fa->opens * open_cost_us);
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(b->files); i++) {
+        file_stats *fb = (file_stats *)strmap_slot(b->files, i, &key, &len);
+        if (fb != NULL && strmap_find(a->files, key, len) == NULL) {
+            add_change(list, "file_new", key, len, 0, fb->opens, fb->opens * open_cost_us);
+        }
+    }
+}
+
+static double diff_directories(const run *a, const run *b, double open_cost_us, change_list *list) {
+    const strmap *dirs_a = a->directories;
+    const strmap *dirs_b = b->directories;
+    double impact_us = 0;
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(dirs_a); i++) {
+        file_stats *da = (file_stats *)strmap_slot(dirs_a, i, &key, &len);
+        if (da == NULL) {
+            continue;
+        }
+        file_stats *db = (file_stats *)strmap_find(dirs_b, key, len);
+        long long opens_b = db != NULL ? db->opens : 0;
+        if (opens_b != da->opens) {
+            add_change(list, "directory", key, len, da->opens, opens_b, (opens_b - da->opens) * open_cost_us);
+            impact_us += (opens_b - da->opens) * open_cost_us;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(dirs_b); i++) {
+        file_stats *db = (file_stats *)strmap_slot(dirs_b, i, &key, &len);
+        if (db != NULL && strmap_find(dirs_a, key, len) == NULL) {
+            add_change(list, "directory", key, len, 0, db->opens, db->opens * open_cost_us);
+            impact_us += db->opens * open_cost_us;
+        }
+    }
+    return impact_us;
+}
+
+static void diff_downloads(const run *a, const run *b, change_list *list) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(a->downloads); i++) {
+        download_stats *da = (download_stats *)strmap_slot(a->downloads, i, &key, &len);
+        if (da == NULL) {
+            continue;
+        }
+        download_stats *db = (download_stats *)strmap_find(b->downloads, key, len);
+        if (db == NULL) {
+            add_change(list, "fetch_removed", key, len, da->count, 0, -da->elapsed_us);
+        } else if (db->count != da->count) {
+            add_change(list, "fetch", key, len, da->count, db->count, db->elapsed_us - da->elapsed_us);
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(b->downloads); i++) {
+        download_stats *db = (download_stats *)strmap_slot(b->downloads, i, &key, &len);
+        if (db != NULL && strmap_find(a->downloads, key, len) == NULL) {
+            add_change(list, "fetch_new", key, len, 0, db->count, db->elapsed_us);
+        }
+    }
+}
+
+// a program whose number of processes or time changed; the time of a process
+// is the last elapsed time it logged, which leaves out the time after its last
+// intercepted call
+static void diff_programs(const run *a, const run *b, change_list *list) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(a->programs); i++) {
+        program_stats *pa = (program_stats *)strmap_slot(a->programs, i, &key, &len);
+        if (pa == NULL) {
+            continue;
+        }
+        program_stats *pb = (program_stats *)strmap_find(b->programs, key, len);
+        long long processes_b = pb != NULL ? pb->processes : 0;
+        long long elapsed_b = pb != NULL ? pb->elapsed_us : 0;
+        if (processes_b != pa->processes || elapsed_b != pa->elapsed_us) {
+            add_change(list, "processes", key, len, pa->processes, processes_b, elapsed_b - pa->elapsed_us);
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(b->programs); i++) {
+        program_stats *pb = (program_stats *)strmap_slot(b->programs, i, &key, &len);
+        if (pb != NULL && strmap_find(a->programs, key, len) == NULL) {
+            add_change(list, "processes", key, len, 0, pb->processes, pb->elapsed_us);
+        }
+    }
+}
+
+static impact_totals diff_runs(const run *a, const run *b, double open_cost_us, change_list *list) {
+    impact_totals totals = {0, 0, 0};
+    diff_files(a, b, open_cost_us, list);
+    totals.opens_us = diff_directories(a, b, open_cost_us, list);
+    diff_downloads(a, b, list);
+    diff_programs(a, b, list);
+
+    // the mean latency of a call, its effect is the change of the total time
+    for (int i = 0; i < NUM_LATENCIES; i++) {
+        const latency_histogram *ha = &a->latencies[i];
+        const latency_histogram *hb = &b->latencies[i];
+        if (ha->count != hb->count || ha->sum != hb->sum) {
+            add_change(list, "latency", LATENCY_NAMES[i], strlen(LATENCY_NAMES[i]), get_mean(ha), get_mean(hb),
+                       (double)(hb->sum - ha->sum));
+        }
+    }
+    totals.downloads_us = (double)(b->latencies[LATENCY_DOWNLOAD].sum - a->latencies[LATENCY_DOWNLOAD].sum);
+    totals.fetch_waits_us = (double)(b->latencies[LATENCY_FETCH_WAIT].sum - a->latencies[LATENCY_FETCH_WAIT].sum);
+
+    // the bytes received at the throughput of the downloads of run A (or B)
+    run_totals ta = get_totals(a);
+    run_totals tb = get_totals(b);
+    if (ta.bytes_received != tb.bytes_received) {
+        double us_per_byte = ta.bytes_received > 0 && ta.download_us > 0 ? (double)ta.download_us / ta.bytes_received :
+                             tb.bytes_received > 0 ? (double)tb.download_us / tb.bytes_received : 0.0;
+        add_change(list, "bytes", "downloads", 9, ta.bytes_received, tb.bytes_received,
+                   (tb.bytes_received - ta.bytes_received) * us_per_byte);
+    }
+    qsort(list->changes, list->num_changes, sizeof(change), compare_changes);
+    return totals;
+}
+
+static size_t limit(size_t size, int top) {
+    return top > 0 && (size_t)top < size ? (size_t)top : size;
+}
+
+static void print_run_table(const char *name, const char *arg, const run *r) {
+    run_totals t = get_totals(r);
+    char buffer[32];
+    char source[64];
+    if (r->num_log_files > 0) {
+        snprintf(source, sizeof(source), "%d log file(s)", r->num_log_files);
+    } else {
+        snprintf(source, sizeof(source), "run summary");
+    }
+    printf("Run %s: %s (%s, %lld lines)\n", name, arg, source, r->lines);
+    printf("  processes: %lld, programs: %zu, opens: %lld (%lld remote), files: %zu, downloads: %lld (%lld failed), "
+           "received: %s\n", t.processes, strmap_size(r->programs), t.opens, t.remote_opens, strmap_size(r->files),
+           t.downloads, t.failed_downloads, format_bytes(t.bytes_received, buffer, sizeof(buffer)));
+}
+
+static void print_table(const char *arg_a, const run *a, const char *arg_b, const run *b, const change_list *list,
+                        const impact_totals *totals, int top, double open_cost_us) {
+    print_run_table("A", arg_a, a);
+    print_run_table("B", arg_b, b);
+
+    printf("\nLatencies (microseconds)\n%-12s %3s %10s %12s %12s %12s %12s %12s\n",
+           "CALL", "RUN", "COUNT", "MEAN", "P50", "P90", "P99", "MAX");
+    for (int i = 0; i < NUM_LATENCIES; i++) {
+        const latency_histogram *h[2] = {&a->latencies[i], &b->latencies[i]};
+        for (int r = 0; r < 2; r++) {
+            printf("%-12s %3s %10lld %12.0f %12.0f %12.0f %12.0f %12lld\n", r == 0 ? LATENCY_NAMES[i] : "",
+                   r == 0 ? "A" : "B", h[r]->count, get_mean(h[r]), get_percentile(h[r], 50),
+                   get_percentile(h[r], 90), get_percentile(h[r], 99), h[r]->max);
+        }
+    }
+
+    printf("\nChanges (top %zu of %zu by estimated time impact, %.0f us per open)\n%12s  %-13s %10s %10s  %s\n",
+           limit(list->num_changes, top), list->num_changes, open_cost_us, "IMPACT [s]", "KIND", "A", "B", "KEY");
+    for (size_t i = 0; i < limit(list->num_changes, top); i++) {
+        const change *c = &list->changes[i];
+        printf("%+12.3f  %-13s %10.0f %10.0f  %.*s\n", c->impact_us / 1e6, c->kind, c->a, c->b, (int)c->len, c->key);
+    }
+    double total = totals->opens_us + totals->downloads_us + totals->fetch_waits_us;
+    printf("\nEstimated I/O time of B compared to A: %+.3f s (opens %+.3f s, downloads %+.3f s, fetch waits %+.3f s)\n",
+           total / 1e6, totals->opens_us / 1e6, totals->downloads_us / 1e6, totals->fetch_waits_us / 1e6);
+}
+
+static void print_json_run(const char *arg, const run *r) {
+    run_totals t = get_totals(r);
+    printf("{\"source\": ");
+    print_json_string(stdout, arg, strlen(arg));
+    printf(", \"log_files\": %d, \"lines\": %lld, \"processes\": %lld, \"programs\": %zu, \"opens\": %lld, "
+           "\"remote_opens\": %lld, \"files\": %zu, \"downloads\": %lld, \"failed_downloads\": %lld, "
+           "\"bytes_received\": %lld}", r->num_log_files, r->lines, t.processes, strmap_size(r->programs), t.opens,
+           t.remote_opens, strmap_size(r->files), t.downloads, t.failed_downloads, t.bytes_received);
+}
+
+static void print_json_latency(const latency_histogram *h) {
+    printf("{\"count\": %lld, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %lld}",
+           h->count, get_mean(h), get_percentile(h, 50), get_percentile(h, 90), get_percentile(h, 99), h->max);
+}
+
+static void print_json(const char *arg_a, const run *a, const char *arg_b, const run *b, const change_list *list,
+                       const impact_totals *totals, int top, double open_cost_us) {
+    printf("{\n  \"runs\": {\n    \"a\": ");
+    print_json_run(arg_a, a);
+    printf(",\n    \"b\": ");
+    print_json_run(arg_b, b);
+    printf("\n  },\n  \"latencies\": {");
+    for (int i = 0; i < NUM_LATENCIES; i++) {
+        printf("%s\n    \"%s\": {\"a\": ", i == 0 ? "" : ",", LATENCY_NAMES[i]);
+        print_json_latency(&a->latencies[i]);
+        printf(", \"b\": ");
+        print_json_latency(&b->latencies[i]);
+        printf("}");
+    }
+    double total = totals->opens_us + totals->downloads_us + totals->fetch_waits_us;
+    printf("\n  },\n  \"impact\": {\"total_us\": %.0f, \"opens_us\": %.0f, \"downloads_us\": %.0f, "
+           "\"fetch_waits_us\": %.0f, \"open_cost_us\": %.0f},\n",
+           total, totals->opens_us, totals->downloads_us, totals->fetch_waits_us, open_cost_us);
+    printf("  \"changes\": [");
+    for (size_t i = 0; i < limit(list->num_changes, top); i++) {
+        const change *c = &list->changes[i];
+        printf("%s\n    {\"kind\": \"%s\", \"key\": ", i == 0 ? "" : ",", c->kind);
+        print_json_string(stdout, c->key, c->len);
+        printf(", \"a\": %.1f, \"b\": %.1f, \"impact_us\": %.0f}", c->a, c->b, c->impact_us);
+    }
+    printf("\n  ]\n}\n");
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace diff [OPTIONS] RUN_A RUN_B\n");
+    fprintf(out, "       vdi trace diff [OPTIONS] --save FILE RUN\n");
+    fprintf(out, "Compares the I/O of two runs, e.g., before and after a software update. A run is\n");
+    fprintf(out, "a log file, a directory with log files or a run summary written with --save.\n");
+    fprintf(out, "Reports files opened only in one run, changed open counts per directory, new and\n");
+    fprintf(out, "removed downloads, changed download bytes, latencies of downloads, fetch waits\n");
+    fprintf(out, "and processes, and changed process counts per program, ranked by their\n");
+    fprintf(out, "estimated effect on the time of run B.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --json              print the comparison as JSON\n");
+    fprintf(out, "  --top N             show only the top N changes (default: %d, 0: all)\n", DEFAULT_TOP);
+    fprintf(out, "  --open-cost USEC    estimated time of an open (default: %d)\n", DEFAULT_OPEN_COST_US);
+    fprintf(out, "  --fail-over SECONDS exit with status %d if the estimated I/O time of B exceeds\n", EXIT_REGRESSION);
+    fprintf(out, "                      that of A by more than SECONDS\n");
+    fprintf(out, "  --save FILE         write the run summary of RUN to FILE instead of comparing\n");
+    fprintf(out, "  -j, --threads N     number of threads (default: number of CPUs)\n");
+    fprintf(out, "  -h, --help          show this help\n");
+}
+
+int diff_main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"json", no_argument, NULL, 'J'},
+        {"top", required_argument, NULL, 't'},
+        {"open-cost", required_argument, NULL, 'C'},
+        {"fail-over", required_argument, NULL, 'F'},
+        {"save", required_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    bool json = false;
+    int top = DEFAULT_TOP;
+    double open_cost_us = DEFAULT_OPEN_COST_US;
+    double fail_over = -1;
+    const char *save_path = NULL;
+    int threads = 0;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'J': json = true; break;
+            case 't': top = atoi(optarg); break;
+            case 'C': open_cost_us = atof(optarg); break;
+            case 'F': fail_over = atof(optarg); break;
+            case 'S': save_path = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'h': usage(stdout); return EXIT_SUCCESS;
+            default: usage(stderr); return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != (save_path != NULL ? 1 : 2)) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (save_path != NULL) {
+        run *r = read_run(argv[optind], threads);
+        int ret = r != NULL && save_run(r, save_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        run_free(r);
+        return ret;
+    }
+    run *a = read_run(argv[optind], threads);
+    run *b = a != NULL ? read_run(argv[optind + 1], threads) : NULL;
+    if (b == NULL) {
+        run_free(a);
+        return EXIT_FAILURE;
+    }
+
+    change_list list = {NULL, 0, 0};
+    impact_totals totals = diff_runs(a, b, open_cost_us, &list);
+    if (json) {
+        print_json(argv[optind], a, argv[optind + 1], b, &list, &totals, top, open_cost_us);
+    } else {
+        print_table(argv[optind], a, argv[optind + 1], b, &list, &totals, top, open_cost_us);
+    }
+    double total = totals.opens_us + totals.downloads_us + totals.fetch_waits_us;
+    int ret = fail_over >= 0 && total > fail_over * 1e6 ? EXIT_REGRESSION : EXIT_SUCCESS;
+
+    free(list.changes);
+    run_free(a);
+    run_free(b);
+    return ret;
+}
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// open addressing with linear probing; keys are copied into the map, values
+// are stored inline after a small header in each slot
+typedef struct {
+    uint64_t hash;
+    char *key;      // NULL if the slot is empty
+    size_t len;
+} slot_header;
+
+struct strmap {
+    size_t value_size;
+    size_t slot_size;
+    size_t capacity;    // power of two
+    size_t size;
+    char *slots;
+};
+
+// hashes 8 bytes at a time (multiply and xor-shift per word), keys such as
+// paths and program names are long, so a byte-wise hash dominates the runtime
+uint64_t hash_bytes(const char *data, size_t len) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = len * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    hash *= multiplier;
+    return hash ^ (hash >> 32);
+}
+
+static slot_header *get_slot(const strmap *map, size_t i) {
+    return (slot_header *)(map->slots + i * map->slot_size);
+}
+
+strmap *strmap_create(size_t value_size) {
+    strmap *map = (strmap *)malloc(sizeof(strmap));
+    map->value_size = value_size;
+    map->slot_size = (sizeof(slot_header) + value_size + 7) & ~(size_t)7;
+    map->capacity = 1024;
+    map->size = 0;
+    map->slots = (char *)calloc(map->capacity, map->slot_size);
+    return map;
+}
+
+void strmap_free(strmap *map) {
+    if (map == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(get_slot(map, i)->key);
+    }
+    free(map->slots);
+    free(map);
+}
+
+static void strmap_grow(strmap *map) {
+    strmap old = *map;
+    map->capacity *= 2;
+    map->slots = (char *)calloc(map->capacity, map->slot_size);
+    for (size_t i = 0; i < old.capacity; i++) {
+        slot_header *slot = get_slot(&old, i);
+        if (slot->key == NULL) {
+            continue;
+        }
+        size_t j = slot->hash & (map->capacity - 1);
+        while (get_slot(map, j)->key != NULL) {
+            j = (j + 1) & (map->capacity - 1);
+        }
+        memcpy(get_slot(map, j), slot, map->slot_size);
+    }
+    free(old.slots);
+}
+
+// returns the value for key, inserting a zero-initialized value if necessary
+void *strmap_insert(strmap *map, const char *key, size_t len) {
+    if (2 * (map->size + 1) > map->capacity) {
+        strmap_grow(map);
+    }
+    uint64_t hash = hash_bytes(key, len);
+    size_t i = hash & (map->capacity - 1);
+    while (true) {
+        slot_header *slot = get_slot(map, i);
+        if (slot->key == NULL) {
+            slot->hash = hash;
+            slot->key = (char *)malloc(len + 1);
+            memcpy(slot->key, key, len);
+            slot->key[len] = '\0';
+            slot->len = len;
+            map->size++;
+            return (char *)slot + sizeof(slot_header);
+        }
+        if (slot->hash == hash && slot->len == len && memcmp(slot->key, key, len) == 0) {
+            return (char *)slot + sizeof(slot_header);
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+}
+
+void *strmap_find(const strmap *map, const char *key, size_t len) {
+    uint64_t hash = hash_bytes(key, len);
+    size_t i = hash & (map->capacity - 1);
+    while (true) {
+        slot_header *slot = get_slot(map, i);
+        if (slot->key == NULL) {
+            return NULL;
+        }
+        if (slot->hash == hash && slot->len == len && memcmp(slot->key, key, len) == 0) {
+            return (char *)slot + sizeof(slot_header);
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+}
+
+size_t strmap_size(const strmap *map) {
+    return map->size;
+}
+
+size_t strmap_capacity(const strmap *map) {
+    return map->capacity;
+}
+
+void *strmap_slot(const strmap *map, size_t i, const char **key, size_t *len) {
+    slot_header *slot = get_slot(map, i);
+    if (slot->key == NULL) {
+        return NULL;
+    }
+    if (key != NULL) {
+        *key = slot->key;
+    }
+    if (len != NULL) {
+        *len = slot->len;
+    }
+    return (char *)slot + sizeof(slot_header);
+}
@@ -0,0 +1,1123 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// The index lives in a directory (default: LOG_DIR/.index) with
+//   sources           one line 'ID<TAB>INDEXED_BYTES<TAB>PATH' per log file,
+//                     INDEXED_BYTES is -1 for files that were replaced
+//   segment.N.idx     the postings of the events added by the N-th run of
+//                     'vdi trace index'
+//   lock              serializes concurrent runs of 'vdi trace index'
+// A segment consists of a segment_header, the path table (num_paths
+// key_entry sorted by key = hash of the absolute path), the pid table
+// (num_pids key_entry sorted by key = PID << 32 | hash of the process, see
+// get_pid_key) and the postings referenced by both tables. A posting locates
+// an open event as byte offset of its line in the (decompressed) log file with
+// the given ID. Log files are only appended to, so a later run indexes just the
+// bytes behind INDEXED_BYTES and adds a new segment; queries search all
+// segments with a binary search each. To keep their number small, a run then
+// merges the newest segments as long as the segment before them is not larger
+// than they are together (like a binary counter, so there are about log2 of
+// the number of runs segments and each posting is copied that often).
+
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_KEY_LEN 8192
+#define INDEX_DIR_NAME ".index"
+#define SOURCES_FILE_NAME "sources"
+#define LOCK_FILE_NAME "lock"
+#define SEGMENT_PREFIX "segment."
+#define SEGMENT_SUFFIX ".idx"
+
+static const char SEGMENT_MAGIC[8] = {'V', 'D', 'I', 'I', 'D', 'X', '2', '\n'};
+
+typedef struct {
+    char magic[8];
+    uint64_t num_paths;
+    uint64_t num_pids;
+    uint64_t num_postings;
+} segment_header;
+
+typedef struct {
+    uint64_t key;
+    uint64_t first;   // index of the first posting
+    uint64_t count;
+} key_entry;
+
+typedef struct {
+    uint64_t offset;  // of the line in the decompressed log file
+    uint32_t file_id;
+    uint32_t access;  // ACCESS_READ and/or ACCESS_WRITE
+} posting;
+
+typedef struct {
+    uint64_t key;
+    posting posting;
+} keyed_posting;
+
+typedef struct {
+    char *path;
+    long long indexed;  // bytes indexed so far, -1 if the file was replaced
+} source;
+
+typedef struct {
+    source *sources;
+    int num_sources;
+    int capacity;
+} source_list;
+
+// data shared by the threads that index the new parts of the log files
+typedef struct {
+    log_file *files;
+    const uint64_t *base_offsets;  // offset of files[i].data in the log file
+    const uint32_t *file_ids;
+} index_job;
+
+typedef struct {
+    keyed_posting *entries;
+    size_t size;
+    size_t capacity;
+} posting_list;
+
+// results of one thread
+typedef struct {
+    const index_job *job;
+    posting_list paths;
+    posting_list pids;
+    long long lines;
+} index_builder;
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = (char *)malloc(len);
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static char *get_default_index_dir(void) {
+    char *log_dir = get_default_log_dir();
+    char *index_dir = join_path(log_dir, INDEX_DIR_NAME);
+    free(log_dir);
+    return index_dir;
+}
+
+static void add_source(source_list *list, char *path, long long indexed) {
+    if (list->num_sources == list->capacity) {
+        list->capacity = list->capacity == 0 ? 64 : 2 * list->capacity;
+        list->sources = (source *)realloc(list->sources, list->capacity * sizeof(source));
+    }
+    list->sources[list->num_sources].path = path;
+    list->sources[list->num_sources].indexed = indexed;
+    list->num_sources++;
+}
+
+static void free_sources(source_list *list) {
+    for (int i = 0; i < list->num_sources; i++) {
+        free(list->sources[i].path);
+    }
+    free(list->sources);
+    memset(list, 0, sizeof(source_list));
+}
+
+// reads the list of indexed log files, a missing list is an empty index
+static int read_sources(const char *index_dir, source_list *list) {
+    memset(list, 0, sizeof(source_list));
+    char *path = join_path(index_dir, SOURCES_FILE_NAME);
+    FILE *in = fopen(path, "r");
+    free(path);
+    if (in == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, in)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char *tab1 = strchr(line, '\t');
+        char *tab2 = tab1 == NULL ? NULL : strchr(tab1 + 1, '\t');
+        if (tab2 == NULL || atoi(line) != list->num_sources) {
+            fprintf(stderr, "vdi-trace: ignoring malformed line in index sources: '%s'\n", line);
+            continue;
+        }
+        add_source(list, strdup(tab2 + 1), atoll(tab1 + 1));
+    }
+    free(line);
+    fclose(in);
+    return 0;
+}
+
+// writes to a temporary file that is renamed, so readers never see a partial file
+static int write_sources(const char *index_dir, const source_list *list) {
+    char *path = join_path(index_dir, SOURCES_FILE_NAME);
+    char *tmp_path = join_path(index_dir, SOURCES_FILE_NAME ".tmp");
+    FILE *out = fopen(tmp_path, "w");
+    int ret = -1;
+    if (out != NULL) {
+        for (int i = 0; i < list->num_sources; i++) {
+            fprintf(out, "%d\t%lld\t%s\n", i, list->sources[i].indexed, list->sources[i].path);
+        }
+        if (fclose(out) == 0 && rename(tmp_path, path) == 0) {
+            ret = 0;
+        }
+    }
+    free(tmp_path);
+    free(path);
+    return ret;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// returns the numbers of the segments in index_dir in ascending order
+static int list_segments(const char *index_dir, int **numbers) {
+    *numbers = NULL;
+    DIR *dir = opendir(index_dir);
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    int num_segments = 0;
+    int capacity = 0;
+    struct dirent *entry;
+    size_t prefix_len = strlen(SEGMENT_PREFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(entry->d_name, SEGMENT_PREFIX, prefix_len) != 0) {
+            continue;
+        }
+        long number = strtol(entry->d_name + prefix_len, &end, 10);
+        if (end == entry->d_name + prefix_len || strcmp(end, SEGMENT_SUFFIX) != 0) {
+            continue;
+        }
+        if (num_segments == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            *numbers = (int *)realloc(*numbers, capacity * sizeof(int));
+        }
+        (*numbers)[num_segments++] = (int)number;
+    }
+    closedir(dir);
+    qsort(*numbers, num_segments, sizeof(int), compare_ints);
+    return num_segments;
+}
+
+static char *get_segment_path(const char *index_dir, int number) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d%s", SEGMENT_PREFIX, number, SEGMENT_SUFFIX);
+    return join_path(index_dir, name);
+}
+
+static void append_posting(posting_list *list, uint64_t key, uint64_t offset, uint32_t file_id, int access) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity == 0 ? 4096 : 2 * list->capacity;
+        list->entries = (keyed_posting *)realloc(list->entries, list->capacity * sizeof(keyed_posting));
+    }
+    keyed_posting *entry = &list->entries[list->size++];
+    entry->key = key;
+    entry->posting.offset = offset;
+    entry->posting.file_id = file_id;
+    entry->posting.access = access;
+}
+
+static void append_postings(posting_list *into, const posting_list *from) {
+    if (into->size + from->size > into->capacity) {
+        into->capacity = into->size + from->size;
+        into->entries = (keyed_posting *)realloc(into->entries, into->capacity * sizeof(keyed_posting));
+    }
+    memcpy(into->entries + into->size, from->entries, from->size * sizeof(keyed_posting));
+    into->size += from->size;
+}
+
+// the absolute path of an open event as used by summarize (URLs and paths
+// relative to a directory fd are taken as is)
+static size_t get_event_path(const log_record *record, const open_event *event, char *buffer, size_t size) {
+    if (event->remote || event->dirfd != AT_FDCWD) {
+        field no_cwd = {"", 0};
+        return make_absolute_path(no_cwd, event->path, buffer, size);
+    }
+    return make_absolute_path(record->columns[COL_CWD], event->path, buffer, size);
+}
+
+// processes on different hosts or at different times may have the same PID,
+// the low bits tell them apart (the process key of summarize without the
+// PID); the PID in the high bits keeps the processes with a PID adjacent
+static uint64_t get_pid_key(const log_record *record) {
+    char process_key[MAX_KEY_LEN];
+    size_t len = get_process_key(record, process_key, sizeof(process_key));
+    const char *tab = memchr(process_key, '\t', len);
+    size_t pid_len = tab == NULL ? len : (size_t)(tab - process_key);
+    uint64_t pid = (uint64_t)field_to_ll(record->columns[COL_PID]);
+    return pid << 32 | (hash_bytes(process_key + pid_len, len - pid_len) & 0xffffffffULL);
+}
+
+static void index_chunk(void *state, const log_chunk *chunk) {
+    index_builder *builder = (index_builder *)state;
+    const index_job *job = builder->job;
+    const log_file *file = &job->files[chunk->file_index];
+    uint64_t base_offset = job->base_offsets[chunk->file_index] + (chunk->data - file->data);
+    uint32_t file_id = job->file_ids[chunk->file_index];
+    const char *ptr = chunk->data;
+    const char *end = chunk->data + chunk->size;
+    log_record record;
+    open_event event;
+    char path[MAX_KEY_LEN];
+    while (ptr < end) {
+        const char *newline = memchr(ptr, '\n', end - ptr);
+        const char *line_end = newline == NULL ? end : newline;
+        size_t len = line_end - ptr;
+        if (len > 0) {
+            builder->lines++;
+            if (split_record(ptr, len, &record) > COL_FUNC && parse_open_event(&record, &event)) {
+                uint64_t offset = base_offset + (ptr - chunk->data);
+                size_t path_len = get_event_path(&record, &event, path, sizeof(path));
+                append_posting(&builder->paths, hash_bytes(path, path_len), offset, file_id, event.access);
+                append_posting(&builder->pids, get_pid_key(&record), offset, file_id, event.access);
+            }
+        }
+        ptr = line_end + 1;
+    }
+}
+
+static int compare_keyed_postings(const void *a, const void *b) {
+    const keyed_posting *x = (const keyed_posting *)a;
+    const keyed_posting *y = (const keyed_posting *)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    if (x->posting.file_id != y->posting.file_id) {
+        return x->posting.file_id < y->posting.file_id ? -1 : 1;
+    }
+    return (x->posting.offset > y->posting.offset) - (x->posting.offset < y->posting.offset);
+}
+
+// turns the sorted postings into a key table, postings are numbered from first
+static size_t build_key_table(const posting_list *list, uint64_t first, key_entry **table) {
+    *table = (key_entry *)malloc((list->size + 1) * sizeof(key_entry));
+    size_t num_keys = 0;
+    for (size_t i = 0; i < list->size; i++) {
+        if (num_keys == 0 || (*table)[num_keys - 1].key != list->entries[i].key) {
+            (*table)[num_keys].key = list->entries[i].key;
+            (*table)[num_keys].first = first + i;
+            (*table)[num_keys].count = 0;
+            num_keys++;
+        }
+        (*table)[num_keys - 1].count++;
+    }
+    return num_keys;
+}
+
+static bool write_all(FILE *out, const void *data, size_t size) {
+    return size == 0 || fwrite(data, 1, size, out) == size;
+}
+
+static int write_segment(const char *path, posting_list *paths, posting_list *pids) {
+    qsort(paths->entries, paths->size, sizeof(keyed_posting), compare_keyed_postings);
+    qsort(pids->entries, pids->size, sizeof(keyed_posting), compare_keyed_postings);
+    key_entry *path_table;
+    key_entry *pid_table;
+    segment_header header;
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+    header.num_paths = build_key_table(paths, 0, &path_table);
+    header.num_pids = build_key_table(pids, paths->size, &pid_table);
+    header.num_postings = paths->size + pids->size;
+
+    size_t len = strlen(path) + 5;
+    char *tmp_path = (char *)malloc(len);
+    snprintf(tmp_path, len, "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    bool ok = out != NULL;
+    ok = ok && write_all(out, &header, sizeof(header));
+    ok = ok && write_all(out, path_table, header.num_paths * sizeof(key_entry));
+    ok = ok && write_all(out, pid_table, header.num_pids * sizeof(key_entry));
+    for (size_t i = 0; ok && i < paths->size; i++) {
+        ok = write_all(out, &paths->entries[i].posting, sizeof(posting));
+    }
+    for (size_t i = 0; ok && i < pids->size; i++) {
+        ok = write_all(out, &pids->entries[i].posting, sizeof(posting));
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ok = false;
+    }
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "vdi-trace: cannot write index segment '%s': %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path_table);
+    free(pid_table);
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    void *mapping;
+    size_t size;
+    const segment_header *header;
+    const key_entry *path_table;
+    const key_entry *pid_table;
+    const posting *postings;
+} segment;
+
+static int open_segment(const char *path, segment *seg) {
+    memset(seg, 0, sizeof(segment));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(segment_header)) {
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    const segment_header *header = (const segment_header *)mapping;
+    size_t expected = sizeof(segment_header) + (header->num_paths + header->num_pids) * sizeof(key_entry) +
+                      header->num_postings * sizeof(posting);
+    if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || expected != (size_t)st.st_size) {
+        munmap(mapping, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    seg->mapping = mapping;
+    seg->size = st.st_size;
+    seg->header = header;
+    seg->path_table = (const key_entry *)(header + 1);
+    seg->pid_table = seg->path_table + header->num_paths;
+    seg->postings = (const posting *)(seg->pid_table + header->num_pids);
+    return 0;
+}
+
+static const key_entry *get_key_table(const segment *seg, bool pids, uint64_t *num_keys) {
+    *num_keys = pids ? seg->header->num_pids : seg->header->num_paths;
+    return pids ? seg->pid_table : seg->path_table;
+}
+
+// walks the key tables (pid or path tables) of segments in the order of their
+// keys: appends an entry per key with the postings numbered from first to
+// *merged if it is not NULL, and writes the postings of the keys to out if it
+// is not NULL; returns the number of postings
+static uint64_t merge_key_tables(const segment *segments, int num_segments, bool pids, uint64_t first,
+                                 key_entry **merged, size_t *num_merged, FILE *out, bool *ok) {
+    uint64_t *positions = (uint64_t *)calloc(num_segments, sizeof(uint64_t));
+    size_t capacity = 0;
+    uint64_t num_postings = 0;
+    while (true) {
+        bool found = false;
+        uint64_t key = 0;
+        for (int i = 0; i < num_segments; i++) {
+            uint64_t num_keys;
+            const key_entry *table = get_key_table(&segments[i], pids, &num_keys);
+            if (positions[i] < num_keys && (!found || table[positions[i]].key < key)) {
+                key = table[positions[i]].key;
+                found = true;
+            }
+        }
+        if (!found) {
+            break;
+        }
+        uint64_t count = 0;
+        for (int i = 0; i < num_segments; i++) {
+            uint64_t num_keys;
+            const key_entry *table = get_key_table(&segments[i], pids, &num_keys);
+            if (positions[i] < num_keys && table[positions[i]].key == key) {
+                const key_entry *entry = &table[positions[i]++];
+                if (entry->first + entry->count > segments[i].header->num_postings) {
+                    continue;
+                }
+                if (out != NULL && *ok) {
+                    *ok = write_all(out, &segments[i].postings[entry->first], entry->count * sizeof(posting));
+                }
+                count += entry->count;
+            }
+        }
+        if (merged != NULL) {
+            if (*num_merged == capacity) {
+                capacity = capacity == 0 ? 4096 : 2 * capacity;
+                *merged = (key_entry *)realloc(*merged, capacity * sizeof(key_entry));
+            }
+            key_entry *entry = &(*merged)[(*num_merged)++];
+            entry->key = key;
+            entry->first = first + num_postings;
+            entry->count = count;
+        }
+        num_postings += count;
+    }
+    free(positions);
+    return num_postings;
+}
+
+// merges segments into one that replaces the last of them (readers that list
+// the segments meanwhile may see postings twice, which they drop)
+static int merge_segments(const char *index_dir, const int *numbers, const segment *segments, int num_segments) {
+    key_entry *path_table = NULL;
+    key_entry *pid_table = NULL;
+    size_t num_paths = 0;
+    size_t num_pids = 0;
+    uint64_t num_path_postings = merge_key_tables(segments, num_segments, false, 0, &path_table, &num_paths,
+                                                  NULL, NULL);
+    uint64_t num_pid_postings = merge_key_tables(segments, num_segments, true, num_path_postings, &pid_table,
+                                                 &num_pids, NULL, NULL);
+    segment_header header;
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+    header.num_paths = num_paths;
+    header.num_pids = num_pids;
+    header.num_postings = num_path_postings + num_pid_postings;
+
+    char *path = get_segment_path(index_dir, numbers[num_segments - 1]);
+    size_t len = strlen(path) + 5;
+    char *tmp_path = (char *)malloc(len);
+    snprintf(tmp_path, len, "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    bool ok = out != NULL;
+    ok = ok && write_all(out, &header, sizeof(header));
+    ok = ok && write_all(out, path_table, num_paths * sizeof(key_entry));
+    ok = ok && write_all(out, pid_table, num_pids * sizeof(key_entry));
+    if (ok) {
+        merge_key_tables(segments, num_segments, false, 0, NULL, NULL, out, &ok);
+        merge_key_tables(segments, num_segments, true, 0, NULL, NULL, out, &ok);
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ok = false;
+    }
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "vdi-trace: cannot write index segment '%s': %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    for (int i = 0; ok && i < num_segments - 1; i++) {
+        char *merged_path = get_segment_path(index_dir, numbers[i]);
+        unlink(merged_path);
+        free(merged_path);
+    }
+    free(tmp_path);
+    free(path);
+    free(path_table);
+    free(pid_table);
+    return ok ? 0 : -1;
+}
+
+// merges the newest segments while the one before them holds no more
+// postings than they do together; returns the number of merged segments
+static int compact_segments(const char *index_dir) {
+    int *numbers;
+    int num_segments = list_segments(index_dir, &numbers);
+    segment *segments = (segment *)calloc(num_segments + 1, sizeof(segment));
+    int num_open = 0;
+    while (num_open < num_segments) {
+        char *path = get_segment_path(index_dir, numbers[num_open]);
+        int ret = open_segment(path, &segments[num_open]);
+        free(path);
+        if (ret != 0) {
+            break;
+        }
+        num_open++;
+    }
+    int first = num_segments;
+    if (num_open == num_segments && num_segments > 1) {
+        first = num_segments - 1;
+        uint64_t newer = segments[first].header->num_postings;
+        while (first > 0 && segments[first - 1].header->num_postings <= newer) {
+            first--;
+            newer += segments[first].header->num_postings;
+        }
+    }
+    int merged = num_segments - first;
+    if (merged < 2 || merge_segments(index_dir, numbers + first, segments + first, merged) != 0) {
+        merged = 0;
+    }
+    for (int i = 0; i < num_open; i++) {
+        munmap(segments[i].mapping, segments[i].size);
+    }
+    free(segments);
+    free(numbers);
+    return merged;
+}
+
+static bool has_invalid_segments(const char *index_dir) {
+    int *numbers;
+    int num_segments = list_segments(index_dir, &numbers);
+    bool invalid = false;
+    for (int i = 0; i < num_segments && !invalid; i++) {
+        char *path = get_segment_path(index_dir, numbers[i]);
+        segment seg;
+        if (open_segment(path, &seg) != 0) {
+            invalid = errno != ENOENT;
+        } else {
+            munmap(seg.mapping, seg.size);
+        }
+        free(path);
+    }
+    free(numbers);
+    return invalid;
+}
+
+static void remove_segments(const char *index_dir) {
+    int *numbers;
+    int num_segments = list_segments(index_dir, &numbers);
+    for (int i = 0; i < num_segments; i++) {
+        char *path = get_segment_path(index_dir, numbers[i]);
+        unlink(path);
+        free(path);
+    }
+    free(numbers);
+}
+
+static void index_usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace index [OPTIONS] [LOG_FILE|LOG_DIR ...]\n");
+    fprintf(out, "Adds the open events of the given log files to the index used by 'vdi trace\n");
+    fprintf(out, "who-read' and 'vdi trace inputs'. Only the parts of the log files that were not\n");
+    fprintf(out, "indexed before are read. Without arguments the log directory ($VDI_LOG_DIR or\n");
+    fprintf(out, "$HOME/.vdi/logs) is indexed.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --index DIR     index directory (default: LOG_DIR/%s)\n", INDEX_DIR_NAME);
+    fprintf(out, "  -j, --threads N number of threads (default: number of CPUs)\n");
+    fprintf(out, "  -h, --help      show this help\n");
+}
+
+int index_main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"index", required_argument, NULL, 'i'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    char *index_dir = NULL;
+    int threads = 0;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': free(index_dir); index_dir = strdup(optarg); break;
+            case 'j': threads = atoi(optarg); break;
+            case 'h': index_usage(stdout); free(index_dir); return EXIT_SUCCESS;
+            default: index_usage(stderr); free(index_dir); return EXIT_FAILURE;
+        }
+    }
+    if (index_dir == NULL) {
+        index_dir = get_default_index_dir();
+    }
+
+    char **paths;
+    int num_paths = collect_log_files(argc - optind, argv + optind, &paths);
+    if (num_paths < 0) {
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (mkdir(index_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "vdi-trace: cannot create index directory '%s': %s\n", index_dir, strerror(errno));
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+    char *lock_path = join_path(index_dir, LOCK_FILE_NAME);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    free(lock_path);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) != 0) {
+        fprintf(stderr, "vdi-trace: cannot lock index '%s': %s\n", index_dir, strerror(errno));
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+
+    source_list sources;
+    if (read_sources(index_dir, &sources) != 0) {
+        fprintf(stderr, "vdi-trace: cannot read index '%s': %s\n", index_dir, strerror(errno));
+        close(lock_fd);
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+    if (has_invalid_segments(index_dir)) {
+        // an older version or a damaged segment: index all logs again
+        fprintf(stderr, "vdi-trace: rebuilding index '%s' (older format or damaged segments)\n", index_dir);
+        remove_segments(index_dir);
+        free_sources(&sources);
+    }
+    strmap *source_ids = strmap_create(sizeof(int));
+    for (int i = 0; i < sources.num_sources; i++) {
+        if (sources.sources[i].indexed >= 0) {
+            char *path = sources.sources[i].path;
+            *(int *)strmap_insert(source_ids, path, strlen(path)) = i + 1;
+        }
+    }
+
+    // open the log files and cut off what has been indexed and incomplete last lines
+    log_file *files = (log_file *)calloc(num_paths + 1, sizeof(log_file));
+    uint64_t *base_offsets = (uint64_t *)calloc(num_paths + 1, sizeof(uint64_t));
+    uint32_t *file_ids = (uint32_t *)calloc(num_paths + 1, sizeof(uint32_t));
+    long long *indexed = (long long *)calloc(num_paths + 1, sizeof(long long));
+    int num_files = 0;
+    for (int i = 0; i < num_paths; i++) {
+        char absolute_path[PATH_MAX];
+        if (realpath(paths[i], absolute_path) == NULL ||
+            log_file_open(absolute_path, &files[num_files]) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+            continue;
+        }
+        num_files++;
+    }
+    int num_threads = get_num_threads(threads);
+    decompress_log_files(files, num_files, num_threads);
+    size_t bytes = 0;
+    int num_new_files = 0;
+    for (int i = 0; i < num_files; i++) {
+        log_file *file = &files[i];
+        const char *last_newline = file->size == 0 ? NULL : memrchr(file->data, '\n', file->size);
+        long long complete = last_newline == NULL ? 0 : last_newline - file->data + 1;
+        int *id = (int *)strmap_find(source_ids, file->path, strlen(file->path));
+        long long done = id == NULL ? 0 : sources.sources[*id - 1].indexed;
+        if (id != NULL && complete < done) {
+            // the file was replaced, the postings of the old file become invalid
+            sources.sources[*id - 1].indexed = -1;
+            id = NULL;
+            done = 0;
+        }
+        if (id == NULL) {
+            add_source(&sources, strdup(file->path), 0);
+            id = (int *)strmap_insert(source_ids, file->path, strlen(file->path));
+            *id = sources.num_sources;
+            num_new_files++;
+        }
+        file_ids[i] = *id - 1;
+        base_offsets[i] = done;
+        indexed[i] = complete;
+        file->data += done;
+        file->size = complete - done;
+        bytes += file->size;
+    }
+
+    log_chunk *chunks;
+    int num_chunks = split_into_chunks(files, num_files, CHUNK_SIZE, &chunks);
+    if (num_threads > num_chunks) {
+        num_threads = num_chunks > 0 ? num_chunks : 1;
+    }
+    index_job job = {files, base_offsets, file_ids};
+    index_builder *builders = (index_builder *)calloc(num_threads, sizeof(index_builder));
+    void **states = (void **)malloc(num_threads * sizeof(void *));
+    for (int t = 0; t < num_threads; t++) {
+        builders[t].job = &job;
+        states[t] = &builders[t];
+    }
+    process_chunks_in_parallel(chunks, num_chunks, num_threads, index_chunk, states);
+    for (int t = 1; t < num_threads; t++) {
+        append_postings(&builders[0].paths, &builders[t].paths);
+        append_postings(&builders[0].pids, &builders[t].pids);
+        builders[0].lines += builders[t].lines;
+        free(builders[t].paths.entries);
+        free(builders[t].pids.entries);
+    }
+
+    int ret = EXIT_SUCCESS;
+    int segment = -1;
+    if (builders[0].paths.size > 0) {
+        int *numbers;
+        int num_segments = list_segments(index_dir, &numbers);
+        segment = num_segments > 0 ? numbers[num_segments - 1] + 1 : 0;
+        free(numbers);
+        char *segment_path = get_segment_path(index_dir, segment);
+        if (write_segment(segment_path, &builders[0].paths, &builders[0].pids) != 0) {
+            ret = EXIT_FAILURE;
+        }
+        free(segment_path);
+    }
+    if (ret == EXIT_SUCCESS) {
+        for (int i = 0; i < num_files; i++) {
+            sources.sources[file_ids[i]].indexed = indexed[i];
+        }
+        if (write_sources(index_dir, &sources) != 0) {
+            fprintf(stderr, "vdi-trace: cannot write index sources in '%s': %s\n", index_dir, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    int merged = ret == EXIT_SUCCESS ? compact_segments(index_dir) : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (ret == EXIT_SUCCESS) {
+        char buffer[32];
+        printf("Indexed %zu open events in %lld new lines (%s) of %d log file(s) (%d new) in %.2f s",
+               builders[0].paths.size, builders[0].lines, format_bytes(bytes, buffer, sizeof(buffer)),
+               num_files, num_new_files, seconds);
+        if (segment >= 0) {
+            printf(", added segment %d", segment);
+        }
+        if (merged > 0) {
+            printf(", merged %d segments", merged);
+        }
+        printf("\n");
+    }
+
+    free(builders[0].paths.entries);
+    free(builders[0].pids.entries);
+    free(builders);
+    free(states);
+    free(chunks);
+    for (int i = 0; i < num_files; i++) {
+        log_file_close(&files[i]);
+    }
+    free(files);
+    free(base_offsets);
+    free(file_ids);
+    free(indexed);
+    for (int i = 0; i < num_paths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    strmap_free(source_ids);
+    free_sources(&sources);
+    close(lock_fd);
+    free(index_dir);
+    return ret;
+}
+
+// queries
+
+typedef struct {
+    source_list sources;
+    segment *segments;
+    int num_segments;
+    log_file *files;     // log files opened on demand, indexed by file id
+    bool *file_failed;
+} index_reader;
+
+static int open_index(const char *index_dir, index_reader *reader) {
+    memset(reader, 0, sizeof(index_reader));
+    if (read_sources(index_dir, &reader->sources) != 0) {
+        fprintf(stderr, "vdi-trace: cannot read index '%s': %s\n", index_dir, strerror(errno));
+        return -1;
+    }
+    if (reader->sources.num_sources == 0) {
+        fprintf(stderr, "vdi-trace: index '%s' is empty, run 'vdi trace index' first\n", index_dir);
+        return -1;
+    }
+    int *numbers;
+    int num_segments = list_segments(index_dir, &numbers);
+    reader->segments = (segment *)calloc(num_segments + 1, sizeof(segment));
+    for (int i = 0; i < num_segments; i++) {
+        char *path = get_segment_path(index_dir, numbers[i]);
+        if (open_segment(path, &reader->segments[reader->num_segments]) != 0) {
+            // merged into a later segment since it was listed
+            if (errno != ENOENT) {
+                fprintf(stderr, "vdi-trace: ignoring index segment '%s' (run 'vdi trace index'): %s\n", path,
+                        strerror(errno));
+            }
+        } else {
+            reader->num_segments++;
+        }
+        free(path);
+    }
+    free(numbers);
+    reader->files = (log_file *)calloc(reader->sources.num_sources, sizeof(log_file));
+    reader->file_failed = (bool *)calloc(reader->sources.num_sources, sizeof(bool));
+    return 0;
+}
+
+static void close_index(index_reader *reader) {
+    for (int i = 0; i < reader->num_segments; i++) {
+        munmap(reader->segments[i].mapping, reader->segments[i].size);
+    }
+    free(reader->segments);
+    for (int i = 0; i < reader->sources.num_sources; i++) {
+        if (reader->files[i].path != NULL) {
+            log_file_close(&reader->files[i]);
+        }
+    }
+    free(reader->files);
+    free(reader->file_failed);
+    free_sources(&reader->sources);
+}
+
+// returns the position of the first key in table that is not less than key
+static uint64_t find_key(const key_entry *table, uint64_t num_keys, uint64_t key) {
+    uint64_t low = 0;
+    uint64_t high = num_keys;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (table[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int compare_postings(const void *a, const void *b) {
+    const posting *x = (const posting *)a;
+    const posting *y = (const posting *)b;
+    if (x->file_id != y->file_id) {
+        return x->file_id < y->file_id ? -1 : 1;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// collects the postings of the keys from key to last_key from all segments
+// (pids: pid table, otherwise path table) that belong to files that are still
+// valid, each once
+static posting *find_postings(const index_reader *reader, uint64_t key, uint64_t last_key, bool pids,
+                              size_t *num_postings) {
+    size_t size = 0;
+    size_t capacity = 0;
+    posting *result = NULL;
+    for (int i = 0; i < reader->num_segments; i++) {
+        const segment *seg = &reader->segments[i];
+        uint64_t num_keys;
+        const key_entry *table = get_key_table(seg, pids, &num_keys);
+        for (uint64_t k = find_key(table, num_keys, key); k < num_keys && table[k].key <= last_key; k++) {
+            const key_entry *entry = &table[k];
+            if (entry->first + entry->count > seg->header->num_postings) {
+                continue;
+            }
+            for (uint64_t j = 0; j < entry->count; j++) {
+                const posting *p = &seg->postings[entry->first + j];
+                // postings of files replaced later or of a run that did not finish
+                if (p->file_id >= (uint32_t)reader->sources.num_sources ||
+                    reader->sources.sources[p->file_id].indexed < 0) {
+                    continue;
+                }
+                if (size == capacity) {
+                    capacity = capacity == 0 ? 64 : 2 * capacity;
+                    result = (posting *)realloc(result, capacity * sizeof(posting));
+                }
+                result[size++] = *p;
+            }
+        }
+    }
+    // a segment and the merged segment that replaces it may both have been read
+    qsort(result, size, sizeof(posting), compare_postings);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (num_unique == 0 || compare_postings(&result[num_unique - 1], &result[i]) != 0) {
+            result[num_unique++] = result[i];
+        }
+    }
+    *num_postings = num_unique;
+    return result;
+}
+
+// returns the line at the offset of a posting, reading (and decompressing) the
+// log file on first use; returns false if the file cannot be read
+static bool get_posting_line(index_reader *reader, const posting *p, const char **line, size_t *len) {
+    log_file *file = &reader->files[p->file_id];
+    if (file->path == NULL && !reader->file_failed[p->file_id]) {
+        const char *path = reader->sources.sources[p->file_id].path;
+        if (log_file_open(path, file) != 0 || decompress_log_file(file) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", path, strerror(errno));
+            if (file->path != NULL) {
+                log_file_close(file);
+            }
+            reader->file_failed[p->file_id] = true;
+        }
+    }
+    if (reader->file_failed[p->file_id] || p->offset >= file->size) {
+        return false;
+    }
+    *line = file->data + p->offset;
+    const char *newline = memchr(*line, '\n', file->size - p->offset);
+    *len = newline == NULL ? file->size - p->offset : (size_t)(newline - *line);
+    return true;
+}
+
+typedef struct {
+    long long opens;
+    int access;
+} access_stats;
+
+static void query_usage(FILE *out, const char *command) {
+    if (strcmp(command, "who-read") == 0) {
+        fprintf(out, "Usage: vdi trace who-read [OPTIONS] PATH\n");
+        fprintf(out, "Lists the processes that opened PATH (relative paths are relative to the current\n");
+        fprintf(out, "directory) for reading, using the index built by 'vdi trace index'.\n\n");
+    } else {
+        fprintf(out, "Usage: vdi trace inputs [OPTIONS] PID\n");
+        fprintf(out, "Lists the files that processes with PID opened for reading, using the index\n");
+        fprintf(out, "built by 'vdi trace index'. Processes on different hosts or at different times\n");
+        fprintf(out, "may have the same PID, they are listed separately.\n\n");
+    }
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --index DIR     index directory (default: LOG_DIR/%s)\n", INDEX_DIR_NAME);
+    fprintf(out, "  -w, --writes    %s\n", strcmp(command, "who-read") == 0 ?
+            "list the processes that opened PATH for writing instead" :
+            "list the files opened for writing (outputs) instead");
+    fprintf(out, "  -h, --help      show this help\n");
+}
+
+static void print_process_key(const char *key, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        putchar(key[i] == '\t' ? ' ' : key[i]);
+    }
+}
+
+// who-read PATH: the processes are collected from the path postings whose line
+// really refers to PATH (different paths may have the same hash)
+static void query_path(index_reader *reader, const char *path_arg, int access_mask) {
+    char path[MAX_KEY_LEN];
+    char cwd[PATH_MAX];
+    field path_field = {path_arg, strlen(path_arg)};
+    field cwd_field = {"", 0};
+    if (getcwd(cwd, sizeof(cwd)) != NULL && strstr(path_arg, "://") == NULL) {
+        cwd_field.ptr = cwd;
+        cwd_field.len = strlen(cwd);
+    }
+    size_t path_len = make_absolute_path(cwd_field, path_field, path, sizeof(path));
+
+    size_t num_postings;
+    uint64_t hash = hash_bytes(path, path_len);
+    posting *postings = find_postings(reader, hash, hash, false, &num_postings);
+    strmap *processes = strmap_create(sizeof(access_stats));
+    log_record record;
+    open_event event;
+    char event_path[MAX_KEY_LEN];
+    char process_key[MAX_KEY_LEN];
+    for (size_t i = 0; i < num_postings; i++) {
+        const char *line;
+        size_t len;
+        if (!(postings[i].access & access_mask) || !get_posting_line(reader, &postings[i], &line, &len)) {
+            continue;
+        }
+        if (split_record(line, len, &record) <= COL_FUNC || !parse_open_event(&record, &event)) {
+            continue;
+        }
+        size_t event_path_len = get_event_path(&record, &event, event_path, sizeof(event_path));
+        if (event_path_len != path_len || memcmp(event_path, path, path_len) != 0) {
+            continue;
+        }
+        size_t key_len = get_process_key(&record, process_key, sizeof(process_key));
+        access_stats *stats = (access_stats *)strmap_insert(processes, process_key, key_len);
+        stats->opens++;
+        stats->access |= event.access;
+    }
+
+    map_entry *entries = get_sorted_entries(processes, compare_entries_by_key);
+    for (size_t i = 0; i < strmap_size(processes); i++) {
+        access_stats *stats = (access_stats *)entries[i].value;
+        printf("%c%c %6lld  ", stats->access & ACCESS_READ ? 'r' : '-', stats->access & ACCESS_WRITE ? 'w' : '-',
+               stats->opens);
+        print_process_key(entries[i].key, entries[i].len);
+        putchar('\n');
+    }
+    free(entries);
+    strmap_free(processes);
+    free(postings);
+}
+
+// inputs PID: the files per process with that PID (key 'PROCESS_KEY\nPATH')
+static void query_pid(index_reader *reader, long long pid, int access_mask) {
+    size_t num_postings;
+    posting *postings = find_postings(reader, (uint64_t)pid << 32, (uint64_t)pid << 32 | 0xffffffffULL, true,
+                                      &num_postings);
+    strmap *io = strmap_create(sizeof(access_stats));
+    log_record record;
+    open_event event;
+    char io_key[MAX_KEY_LEN];
+    for (size_t i = 0; i < num_postings; i++) {
+        const char *line;
+        size_t len;
+        if (!(postings[i].access & access_mask) || !get_posting_line(reader, &postings[i], &line, &len)) {
+            continue;
+        }
+        if (split_record(line, len, &record) <= COL_FUNC || !parse_open_event(&record, &event) ||
+            field_to_ll(record.columns[COL_PID]) != pid) {
+            continue;
+        }
+        size_t key_len = get_process_key(&record, io_key, sizeof(io_key));
+        io_key[key_len] = '\n';
+        key_len += 1 + get_event_path(&record, &event, io_key + key_len + 1, sizeof(io_key) - key_len - 1);
+        access_stats *stats = (access_stats *)strmap_insert(io, io_key, key_len);
+        stats->opens++;
+        stats->access |= event.access;
+    }
+
+    // the keys sort by process first, so the files of a process are adjacent
+    map_entry *entries = get_sorted_entries(io, compare_entries_by_key);
+    const char *last_process = NULL;
+    size_t last_process_len = 0;
+    for (size_t i = 0; i < strmap_size(io); i++) {
+        const char *newline = memchr(entries[i].key, '\n', entries[i].len);
+        size_t process_len = newline - entries[i].key;
+        if (last_process == NULL || process_len != last_process_len ||
+            memcmp(last_process, entries[i].key, process_len) != 0) {
+            last_process = entries[i].key;
+            last_process_len = process_len;
+            print_process_key(entries[i].key, process_len);
+            putchar('\n');
+        }
+        access_stats *stats = (access_stats *)entries[i].value;
+        printf("  %c%c %6lld  %.*s\n", stats->access & ACCESS_READ ? 'r' : '-',
+               stats->access & ACCESS_WRITE ? 'w' : '-', stats->opens,
+               (int)(entries[i].len - process_len - 1), newline + 1);
+    }
+    free(entries);
+    strmap_free(io);
+    free(postings);
+}
+
+static int query_main(int argc, char **argv, bool by_pid) {
+    static struct option long_options[] = {
+        {"index", required_argument, NULL, 'i'},
+        {"writes", no_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *command = by_pid ? "inputs" : "who-read";
+    char *index_dir = NULL;
+    int access_mask = ACCESS_READ;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "wh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': free(index_dir); index_dir = strdup(optarg); break;
+            case 'w': access_mask = ACCESS_WRITE; break;
+            case 'h': query_usage(stdout, command); free(index_dir); return EXIT_SUCCESS;
+            default: query_usage(stderr, command); free(index_dir); return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        query_usage(stderr, command);
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+    if (index_dir == NULL) {
+        index_dir = get_default_index_dir();
+    }
+
+    index_reader reader;
+    if (open_index(index_dir, &reader) != 0) {
+        free(index_dir);
+        return EXIT_FAILURE;
+    }
+    if (by_pid) {
+        query_pid(&reader, atoll(argv[optind]), access_mask);
+    } else {
+        query_path(&reader, argv[optind], access_mask);
+    }
+    close_index(&reader);
+    free(index_dir);
+    return EXIT_SUCCESS;
+}
+
+int who_read_main(int argc, char **argv) {
+    return query_main(argc, argv, false);
+}
+
+int inputs_main(int argc, char **argv) {
+    return query_main(argc, argv, true);
+}
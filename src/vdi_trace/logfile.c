@@ -0,0 +1,252 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define STRING_CONST_ENVVAR_VDI_LOG_DIR "VDI_LOG_DIR"
+#define STRING_CONST_LOG_DIR_DEFAULT ".vdi/logs"
+
+// suffixes of uncompressed and compressed (VDI_LOG_COMPRESS) log files
+static const char *LOG_FILE_SUFFIXES[] = {".log", ".log.zst", ".log.lz4"};
+static const int NUM_LOG_FILE_SUFFIXES = sizeof(LOG_FILE_SUFFIXES) / sizeof(LOG_FILE_SUFFIXES[0]);
+
+// maps the log file at path into memory
+// returns 0 on success or -1 (errno is set)
+int log_file_open(const char *path, log_file *file) {
+    memset(file, 0, sizeof(log_file));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    file->path = strdup(path);
+    file->size = st.st_size;
+    if (file->size > 0) {
+        void *mapping = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            int saved_errno = errno;
+            close(fd);
+            free(file->path);
+            file->path = NULL;
+            errno = saved_errno;
+            return -1;
+        }
+        // the file is read once from front to back
+        madvise(mapping, file->size, MADV_SEQUENTIAL);
+        file->mapping = mapping;
+        file->mapping_size = file->size;
+        file->data = (const char *)mapping;
+    }
+    close(fd);
+    return 0;
+}
+
+void log_file_close(log_file *file) {
+    if (file->mapping != NULL) {
+        munmap(file->mapping, file->mapping_size);
+    }
+    free(file->buffer);
+    free(file->path);
+    memset(file, 0, sizeof(log_file));
+}
+
+char *get_default_log_dir(void) {
+    const char *log_dir = getenv(STRING_CONST_ENVVAR_VDI_LOG_DIR);
+    if (log_dir != NULL && log_dir[0] != '\0') {
+        return strdup(log_dir);
+    }
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+        home = "";
+    }
+    size_t len = strlen(home) + strlen(STRING_CONST_LOG_DIR_DEFAULT) + 2;
+    char *path = (char *)malloc(len);
+    snprintf(path, len, "%s/%s", home, STRING_CONST_LOG_DIR_DEFAULT);
+    return path;
+}
+
+static bool has_suffix(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+static bool is_log_file_name(const char *name) {
+    for (int i = 0; i < NUM_LOG_FILE_SUFFIXES; i++) {
+        if (has_suffix(name, LOG_FILE_SUFFIXES[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void append_path(char ***paths, int *num_paths, int *capacity, char *path) {
+    if (*num_paths == *capacity) {
+        *capacity = *capacity == 0 ? 64 : 2 * *capacity;
+        *paths = (char **)realloc(*paths, *capacity * sizeof(char *));
+    }
+    (*paths)[(*num_paths)++] = path;
+}
+
+// expands the arguments into a list of log files: files are taken as is,
+// directories contribute the files ending in '.log', '.log.zst' or '.log.lz4'
+// (sorted by name); without
+// arguments the default log directory is used
+// returns the number of files or -1 if an argument does not exist
+int collect_log_files(int num_args, char **args, char ***paths) {
+    char *default_dir = NULL;
+    if (num_args == 0) {
+        default_dir = get_default_log_dir();
+        args = &default_dir;
+        num_args = 1;
+    }
+    *paths = NULL;
+    int num_paths = 0;
+    int capacity = 0;
+    for (int i = 0; i < num_args; i++) {
+        struct stat st;
+        if (stat(args[i], &st) != 0) {
+            fprintf(stderr, "vdi-trace: cannot access '%s': %s\n", args[i], strerror(errno));
+            free(default_dir);
+            return -1;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            append_path(paths, &num_paths, &capacity, strdup(args[i]));
+            continue;
+        }
+        DIR *dir = opendir(args[i]);
+        if (dir == NULL) {
+            fprintf(stderr, "vdi-trace: cannot open directory '%s': %s\n", args[i], strerror(errno));
+            free(default_dir);
+            return -1;
+        }
+        int first = num_paths;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.' || !is_log_file_name(entry->d_name)) {
+                continue;
+            }
+            size_t len = strlen(args[i]) + strlen(entry->d_name) + 2;
+            char *path = (char *)malloc(len);
+            snprintf(path, len, "%s/%s", args[i], entry->d_name);
+            append_path(paths, &num_paths, &capacity, path);
+        }
+        closedir(dir);
+        qsort(*paths + first, num_paths - first, sizeof(char *), compare_strings);
+    }
+    free(default_dir);
+    return num_paths;
+}
+
+// splits the files into chunks of about chunk_size bytes that end after a
+// newline (or at the end of a file), so that no line spans two chunks
+// returns the number of chunks
+int split_into_chunks(log_file *files, int num_files, size_t chunk_size, log_chunk **chunks) {
+    int capacity = 64;
+    int num_chunks = 0;
+    *chunks = (log_chunk *)malloc(capacity * sizeof(log_chunk));
+    for (int i = 0; i < num_files; i++) {
+        const char *data = files[i].data;
+        size_t size = files[i].size;
+        size_t offset = 0;
+        while (offset < size) {
+            size_t end = offset + chunk_size;
+            if (end >= size) {
+                end = size;
+            } else {
+                const char *newline = memchr(data + end, '\n', size - end);
+                end = newline == NULL ? size : (size_t)(newline - data) + 1;
+            }
+            if (num_chunks == capacity) {
+                capacity *= 2;
+                *chunks = (log_chunk *)realloc(*chunks, capacity * sizeof(log_chunk));
+            }
+            (*chunks)[num_chunks].file_index = i;
+            (*chunks)[num_chunks].data = data + offset;
+            (*chunks)[num_chunks].size = end - offset;
+            num_chunks++;
+            offset = end;
+        }
+    }
+    return num_chunks;
+}
+
+typedef struct {
+    log_chunk *chunks;
+    int num_chunks;
+    int next_chunk;
+    pthread_mutex_t mutex;
+    chunk_function function;
+} chunk_queue;
+
+typedef struct {
+    chunk_queue *queue;
+    void *state;
+} worker_args;
+
+static void *chunk_worker(void *arg) {
+    worker_args *args = (worker_args *)arg;
+    chunk_queue *queue = args->queue;
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        int i = queue->next_chunk++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->num_chunks) {
+            break;
+        }
+        queue->function(args->state, &queue->chunks[i]);
+    }
+    return NULL;
+}
+
+// calls function for each chunk using num_threads threads; thread t passes
+// states[t] to function, so that each thread accumulates its own results
+void process_chunks_in_parallel(log_chunk *chunks, int num_chunks, int num_threads,
+                                chunk_function function, void **states) {
+    chunk_queue queue = {chunks, num_chunks, 0, PTHREAD_MUTEX_INITIALIZER, function};
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    worker_args *args = (worker_args *)malloc(num_threads * sizeof(worker_args));
+    int started = 0;
+    for (int t = 1; t < num_threads; t++) {
+        args[t].queue = &queue;
+        args[t].state = states[t];
+        if (pthread_create(&threads[t], NULL, chunk_worker, &args[t]) != 0) {
+            break;
+        }
+        started = t;
+    }
+    // the calling thread works as thread 0
+    args[0].queue = &queue;
+    args[0].state = states[0];
+    chunk_worker(&args[0]);
+    for (int t = 1; t <= started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(args);
+    free(threads);
+}
+
+int get_num_threads(int requested) {
+    if (requested > 0) {
+        return requested;
+    }
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (int)num_cpus : 1;
+}
@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char *name;
+    int (*main)(int argc, char **argv);
+    const char *description;
+} command;
+
+static const command COMMANDS[] = {
+    {"summarize", summarize_main, "summarize log files (per-file, per-program, per-process)"},
+    {"cat", cat_main, "print log files, compressed logs are decompressed"},
+    {"index", index_main, "add new log lines to the index for who-read and inputs"},
+    {"who-read", who_read_main, "list the processes that read a file (uses the index)"},
+    {"inputs", inputs_main, "list the files a process read (uses the index)"},
+    {"replay", replay_main, "replay the opens of the logs and report latencies and throughput"},
+    {"merge", merge_main, "merge log files into one log ordered by time"},
+    {"diff", diff_main, "compare the I/O of two runs, ranked by estimated time impact"},
+};
+static const int NUM_COMMANDS = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace COMMAND [OPTIONS] [ARGS]\n\nCommands:\n");
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        fprintf(out, "  %-12s %s\n", COMMANDS[i].name, COMMANDS[i].description);
+    }
+    fprintf(out, "\nRun 'vdi trace COMMAND --help' for the options of a command.\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        usage(stdout);
+        return EXIT_SUCCESS;
+    }
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        if (strcmp(argv[1], COMMANDS[i].name) == 0) {
+            return COMMANDS[i].main(argc - 1, argv + 1);
+        }
+    }
+    fprintf(stderr, "vdi-trace: unknown command '%s'\n", argv[1]);
+    usage(stderr);
+    return EXIT_FAILURE;
+}
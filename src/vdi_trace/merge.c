@@ -0,0 +1,387 @@
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+// vdi trace merge: merges log files into one time-ordered log
+//
+// Every log file is ordered by itself (the lines of a process, or the lines of
+// a session in the order vdi-collectord received them), so a k-way merge with
+// a binary heap over the current line of each file yields the global order
+// without sorting. Only one line per file is held at a time: uncompressed
+// files are read through their memory mapping, compressed ones through the
+// small window of a log_reader, so memory does not grow with the logs.
+//
+// The key of a line is its timestamp (column 1) in microseconds, plus the
+// offset of its host. Wall clocks may step backwards, so the key of a line is
+// raised to the key of the line before it in the same file; ties are broken by
+// the file index, which keeps the lines of a file in their order.
+
+#define MAX_HOST_LEN 256
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    char host[MAX_HOST_LEN];
+    int64_t offset_us;
+} host_offset;
+
+typedef struct {
+    host_offset *offsets;
+    int num_offsets;
+    int capacity;
+} offset_table;
+
+typedef struct {
+    log_file file;
+    log_reader reader;
+    const char *line;
+    size_t len;
+    int64_t key;
+    bool timed;                // the current line has a timestamp
+    int64_t offset_us;         // offset of the host of the current line
+    char host[MAX_HOST_LEN];   // host field the offset was looked up for
+    size_t host_len;
+} merge_input;
+
+// one entry per input with a current line, ordered by (key, input index)
+typedef struct {
+    merge_input *inputs;
+    int *heap;
+    int size;
+} merge_heap;
+
+static bool heap_less(const merge_heap *h, int a, int b) {
+    const merge_input *x = &h->inputs[a];
+    const merge_input *y = &h->inputs[b];
+    return x->key < y->key || (x->key == y->key && a < b);
+}
+
+static void heap_sift_down(merge_heap *h, int i) {
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < h->size && heap_less(h, h->heap[left], h->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < h->size && heap_less(h, h->heap[right], h->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        int tmp = h->heap[i];
+        h->heap[i] = h->heap[smallest];
+        h->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static bool parse_offset(const char *spec, host_offset *offset) {
+    const char *separator = strrchr(spec, '=');
+    if (separator == NULL) {
+        separator = strrchr(spec, ' ');
+    }
+    if (separator == NULL || separator == spec || (size_t)(separator - spec) >= MAX_HOST_LEN) {
+        return false;
+    }
+    char *end;
+    double seconds = strtod(separator + 1, &end);
+    if (end == separator + 1 || *end != '\0') {
+        return false;
+    }
+    memcpy(offset->host, spec, separator - spec);
+    offset->host[separator - spec] = '\0';
+    offset->offset_us = (int64_t)(seconds * 1e6 + (seconds < 0 ? -0.5 : 0.5));
+    return true;
+}
+
+static void add_offset(offset_table *table, const host_offset *offset) {
+    if (table->num_offsets == table->capacity) {
+        table->capacity = table->capacity == 0 ? 16 : 2 * table->capacity;
+        table->offsets = (host_offset *)realloc(table->offsets, table->capacity * sizeof(host_offset));
+    }
+    table->offsets[table->num_offsets++] = *offset;
+}
+
+// reads lines 'HOST SECONDS' (or 'HOST=SECONDS'), '#' starts a comment
+static int read_offsets_file(const char *path, offset_table *table) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[MAX_HOST_LEN + 64];
+    int line_number = 0;
+    int ret = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        char *spec = line + strspn(line, " \t");
+        if (*spec == '\0') {
+            continue;
+        }
+        host_offset offset;
+        if (!parse_offset(spec, &offset)) {
+            fprintf(stderr, "vdi-trace: '%s', line %d: expected 'HOST SECONDS'\n", path, line_number);
+            ret = -1;
+            break;
+        }
+        add_offset(table, &offset);
+    }
+    fclose(in);
+    return ret;
+}
+
+// offset of a host field (column 2); HOST matches any of its '//'-separated
+// elements, i.e., the hostname, the fully qualified hostname or an address
+static int64_t find_offset(const offset_table *table, const char *host, size_t len) {
+    const char *end = host + len;
+    const char *element = host;
+    while (element < end) {
+        const char *next = memmem(element, end - element, "//", 2);
+        size_t element_len = next == NULL ? (size_t)(end - element) : (size_t)(next - element);
+        const char *details = memmem(element, element_len, "%%", 2);
+        if (details != NULL) {
+            element_len = details - element;
+        }
+        for (int i = 0; i < table->num_offsets; i++) {
+            if (strlen(table->offsets[i].host) == element_len &&
+                memcmp(table->offsets[i].host, element, element_len) == 0) {
+                return table->offsets[i].offset_us;
+            }
+        }
+        element = next == NULL ? end : next + 2;
+    }
+    return 0;
+}
+
+// time of a line in microseconds (without offset), or -1 if it has none
+static int64_t get_line_time_us(const char *line, size_t len) {
+    size_t i = 0;
+    int64_t seconds = 0;
+    while (i < len && line[i] >= '0' && line[i] <= '9') {
+        seconds = seconds * 10 + (line[i++] - '0');
+    }
+    if (i == 0 || i == len) {
+        return -1;
+    }
+    if (line[i] == '.') {
+        int64_t usec = 0;
+        for (i++; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+            usec = usec * 10 + (line[i] - '0');
+        }
+        return seconds * 1000000LL + usec;
+    }
+    log_record record;
+    if (split_record(line, len, &record) <= COL_ELAPSED) {
+        return -1;
+    }
+    return get_record_time_us(&record);
+}
+
+// reads the next line of an input and computes its key; returns false at the end
+static bool advance(merge_input *input, const offset_table *offsets) {
+    input->line = log_reader_next(&input->reader, &input->len);
+    if (input->line == NULL) {
+        return false;
+    }
+    int64_t time_us = get_line_time_us(input->line, input->len);
+    input->timed = time_us >= 0;
+    if (!input->timed) {
+        return true;     // keep the line after the line before it
+    }
+    if (offsets->num_offsets > 0) {
+        const char *host = memchr(input->line, ' ', input->len);
+        if (host != NULL) {
+            host++;
+            const char *end = memchr(host, ' ', input->line + input->len - host);
+            size_t host_len = end == NULL ? (size_t)(input->line + input->len - host) : (size_t)(end - host);
+            if (host_len != input->host_len || memcmp(host, input->host, host_len) != 0) {
+                input->offset_us = find_offset(offsets, host, host_len);
+                input->host_len = host_len < MAX_HOST_LEN ? host_len : 0;
+                memcpy(input->host, host, input->host_len);
+            }
+        }
+        time_us += input->offset_us;
+    }
+    if (time_us > input->key) {
+        input->key = time_us;
+    }
+    return true;
+}
+
+// writes a line with its timestamp replaced by the corrected time
+static void write_corrected_line(FILE *out, const merge_input *input) {
+    const char *rest = memchr(input->line, ' ', input->len);
+    if (rest == NULL) {
+        rest = input->line + input->len;
+    }
+    time_t seconds = (time_t)(input->key / 1000000LL);
+    struct tm utc;
+    char utc_buffer[80] = "";
+    if (gmtime_r(&seconds, &utc) != NULL) {
+        strftime(utc_buffer, sizeof(utc_buffer), "%Y-%m-%d+%H:%M:%S+UTC", &utc);
+    }
+    fprintf(out, "%lld.%06lld::%s", (long long)seconds, (long long)(input->key % 1000000LL), utc_buffer);
+    fwrite(rest, 1, input->line + input->len - rest, out);
+    putc('\n', out);
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace merge [OPTIONS] [LOG_FILE|LOG_DIR ...]\n");
+    fprintf(out, "Merges log files (also compressed ones) into one log ordered by time. Each file\n");
+    fprintf(out, "is read once from front to back, so memory does not grow with the logs.\n");
+    fprintf(out, "Without arguments the log directory ($VDI_LOG_DIR or $HOME/.vdi/logs) is used.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  -o, --output FILE       write the merged log to FILE (default: stdout)\n");
+    fprintf(out, "  --offset HOST=SECONDS   add SECONDS (may be negative or fractional) to the times\n");
+    fprintf(out, "                          of HOST (hostname, qualified hostname or address in\n");
+    fprintf(out, "                          column 2), rewriting column 1; repeatable\n");
+    fprintf(out, "  --offsets FILE          read 'HOST SECONDS' lines from FILE\n");
+    fprintf(out, "  --stats                 print the number of lines and the throughput to stderr\n");
+    fprintf(out, "  -h, --help              show this help\n");
+}
+
+int merge_main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"offset", required_argument, NULL, 'O'},
+        {"offsets", required_argument, NULL, 'F'},
+        {"stats", no_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    offset_table offsets;
+    memset(&offsets, 0, sizeof(offsets));
+    const char *output = NULL;
+    bool stats = false;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o': output = optarg; break;
+            case 'O': {
+                host_offset offset;
+                if (!parse_offset(optarg, &offset)) {
+                    fprintf(stderr, "vdi-trace: --offset expects HOST=SECONDS, not '%s'\n", optarg);
+                    free(offsets.offsets);
+                    return EXIT_FAILURE;
+                }
+                add_offset(&offsets, &offset);
+                break;
+            }
+            case 'F':
+                if (read_offsets_file(optarg, &offsets) != 0) {
+                    free(offsets.offsets);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S': stats = true; break;
+            case 'h': usage(stdout); free(offsets.offsets); return EXIT_SUCCESS;
+            default: usage(stderr); free(offsets.offsets); return EXIT_FAILURE;
+        }
+    }
+
+    char **paths;
+    int num_paths = collect_log_files(argc - optind, argv + optind, &paths);
+    if (num_paths < 0) {
+        free(offsets.offsets);
+        return EXIT_FAILURE;
+    }
+    FILE *out = stdout;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "vdi-trace: cannot write '%s': %s\n", output, strerror(errno));
+            for (int i = 0; i < num_paths; i++) {
+                free(paths[i]);
+            }
+            free(paths);
+            free(offsets.offsets);
+            return EXIT_FAILURE;
+        }
+    }
+    static char output_buffer[OUTPUT_BUFFER_SIZE];
+    setvbuf(out, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    merge_input *inputs = (merge_input *)calloc(num_paths > 0 ? num_paths : 1, sizeof(merge_input));
+    merge_heap heap = {inputs, (int *)malloc((num_paths > 0 ? num_paths : 1) * sizeof(int)), 0};
+    long long input_bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < num_paths; i++) {
+        merge_input *input = &inputs[i];
+        input->key = INT64_MIN;
+        if (log_file_open(paths[i], &input->file) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+            failed++;
+        } else if (log_reader_open(&input->file, &input->reader) != 0) {
+            failed++;
+        } else {
+            input_bytes += input->file.size;
+            if (advance(input, &offsets)) {
+                heap.heap[heap.size++] = i;
+            }
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    for (int i = heap.size / 2 - 1; i >= 0; i--) {
+        heap_sift_down(&heap, i);
+    }
+
+    long long lines = 0;
+    long long output_bytes = 0;
+    while (heap.size > 0) {
+        merge_input *input = &inputs[heap.heap[0]];
+        if (input->offset_us != 0 && input->timed) {
+            write_corrected_line(out, input);
+        } else {
+            fwrite(input->line, 1, input->len, out);
+            putc('\n', out);
+        }
+        lines++;
+        output_bytes += input->len + 1;
+        if (!advance(input, &offsets)) {
+            heap.heap[0] = heap.heap[--heap.size];
+        }
+        heap_sift_down(&heap, 0);
+    }
+
+    int ret = EXIT_SUCCESS;
+    if (fflush(out) != 0 || ferror(out)) {
+        fprintf(stderr, "vdi-trace: cannot write '%s': %s\n", output == NULL ? "stdout" : output, strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (stats) {
+        double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        char in_size[32], out_size[32], rate[32];
+        fprintf(stderr, "merged %lld lines of %d files (%s read, %s written) in %.2f s, %s/s\n", lines,
+                num_paths - failed, format_bytes(input_bytes, in_size, sizeof(in_size)),
+                format_bytes(output_bytes, out_size, sizeof(out_size)), seconds,
+                format_bytes(seconds > 0 ? output_bytes / seconds : 0, rate, sizeof(rate)));
+    }
+    for (int i = 0; i < num_paths; i++) {
+        log_reader_close(&inputs[i].reader);
+        log_file_close(&inputs[i].file);
+    }
+    free(inputs);
+    free(heap.heap);
+    free(offsets.offsets);
+    return failed > 0 ? EXIT_FAILURE : ret;
+}
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include "trace.h"
+
+// prints str as a JSON string literal (including the quotes)
+void print_json_string(FILE *out, const char *str, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        switch (c) {
+            case '"': fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (c < 0x20) {
+                    fprintf(out, "\\u%04x", c);
+                } else {
+                    fputc(c, out);
+                }
+        }
+    }
+    fputc('"', out);
+}
+
+// collects the entries of map into an array sorted with compare
+// returns the array (to be freed by the caller), its length is strmap_size(map)
+map_entry *get_sorted_entries(const strmap *map, int (*compare)(const void *, const void *)) {
+    size_t size = strmap_size(map);
+    map_entry *entries = (map_entry *)malloc((size + 1) * sizeof(map_entry));
+    size_t n = 0;
+    for (size_t i = 0; i < strmap_capacity(map); i++) {
+        void *value = strmap_slot(map, i, &entries[n].key, &entries[n].len);
+        if (value != NULL) {
+            entries[n].value = value;
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(map_entry), compare);
+    return entries;
+}
+
+int compare_entries_by_key(const void *a, const void *b) {
+    const map_entry *x = (const map_entry *)a;
+    const map_entry *y = (const map_entry *)b;
+    size_t len = x->len < y->len ? x->len : y->len;
+    int result = memcmp(x->key, y->key, len);
+    if (result != 0) {
+        return result;
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+// formats a number of bytes with a binary unit, e.g. '1.5 GiB'
+const char *format_bytes(double bytes, char *buffer, size_t size) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        unit++;
+    }
+    if (unit == 0) {
+        snprintf(buffer, size, "%.0f %s", bytes, units[unit]);
+    } else {
+        snprintf(buffer, size, "%.1f %s", bytes, units[unit]);
+    }
+    return buffer;
+}
@@ -0,0 +1,258 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "trace.h"
+
+static const char *URL_PREFIXES[] = {
+  "https://",
+  "http://",
+  "ftp://",
+  "vdi://"
+};
+static size_t NUM_URL_PREFIXES = sizeof(URL_PREFIXES) / sizeof(URL_PREFIXES[0]);
+
+// splits a log line (without the newline) at the column separator ' ' into
+// at most MAX_COLUMNS columns, the last column holds the rest of the line
+// returns the number of columns
+int split_record(const char *line, size_t len, log_record *record) {
+    int n = 0;
+    size_t start = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    // compare 16 bytes at a time with ' ' and walk the bits of the match mask
+    const __m128i separator = _mm_set1_epi8(' ');
+    for (; i + 16 <= len && n < MAX_COLUMNS - 1; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(line + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, separator));
+        while (mask != 0 && n < MAX_COLUMNS - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            record->columns[n].ptr = line + start;
+            record->columns[n].len = pos - start;
+            n++;
+            start = pos + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len && n < MAX_COLUMNS - 1; i++) {
+        if (line[i] == ' ') {
+            record->columns[n].ptr = line + start;
+            record->columns[n].len = i - start;
+            n++;
+            start = i + 1;
+        }
+    }
+    record->columns[n].ptr = line + start;
+    record->columns[n].len = len - start;
+    n++;
+    record->num_columns = n;
+    return n;
+}
+
+bool field_equals(field f, const char *str) {
+    size_t len = strlen(str);
+    return f.len == len && memcmp(f.ptr, str, len) == 0;
+}
+
+static bool field_starts_with(field f, const char *prefix) {
+    size_t len = strlen(prefix);
+    return f.len >= len && memcmp(f.ptr, prefix, len) == 0;
+}
+
+long long field_to_ll(field f) {
+    long long value = 0;
+    size_t i = 0;
+    bool negative = false;
+    if (f.len > 0 && f.ptr[0] == '-') {
+        negative = true;
+        i++;
+    }
+    for (; i < f.len && f.ptr[i] >= '0' && f.ptr[i] <= '9'; i++) {
+        value = value * 10 + (f.ptr[i] - '0');
+    }
+    return negative ? -value : value;
+}
+
+// access mode from open flags logged as 'FLAGS::NAMES'
+static int access_from_flags(field flags) {
+    int value = (int)field_to_ll(flags);
+    switch (value & O_ACCMODE) {
+        case O_WRONLY: return ACCESS_WRITE;
+        case O_RDWR: return ACCESS_READ | ACCESS_WRITE;
+        default: return ACCESS_READ;
+    }
+}
+
+// access mode from fopen modes such as 'r', 'rb', 'w', 'a+'
+static int access_from_mode(field mode) {
+    bool plus = memchr(mode.ptr, '+', mode.len) != NULL;
+    if (mode.len > 0 && (mode.ptr[0] == 'w' || mode.ptr[0] == 'a')) {
+        return plus ? ACCESS_READ | ACCESS_WRITE : ACCESS_WRITE;
+    }
+    return plus ? ACCESS_READ | ACCESS_WRITE : ACCESS_READ;
+}
+
+// recognizes the intercepted open calls and extracts path and access mode
+bool parse_open_event(const log_record *record, open_event *event) {
+    if (record->num_columns <= COL_FIRST_ARG) {
+        return false;
+    }
+    field func = record->columns[COL_FUNC];
+    const field *args = record->columns + COL_FIRST_ARG;
+    int num_args = record->num_columns - COL_FIRST_ARG;
+    event->dirfd = AT_FDCWD;
+
+    if (field_equals(func, "open") || field_equals(func, "open64")) {
+        if (num_args < 2) {
+            return false;
+        }
+        event->path = args[0];
+        event->access = access_from_flags(args[1]);
+    } else if (field_equals(func, "openat")) {
+        if (num_args < 3) {
+            return false;
+        }
+        event->dirfd = (int)field_to_ll(args[0]);
+        event->path = args[1];
+        event->access = access_from_flags(args[2]);
+    } else if (field_equals(func, "fopen") || field_equals(func, "fopen64") || field_equals(func, "freopen")) {
+        if (num_args < 2) {
+            return false;
+        }
+        event->path = args[0];
+        event->access = access_from_mode(args[1]);
+    } else if (field_equals(func, "fopenat")) {
+        if (num_args < 3) {
+            return false;
+        }
+        event->dirfd = (int)field_to_ll(args[0]);
+        event->path = args[1];
+        event->access = access_from_mode(args[2]);
+    } else {
+        return false;
+    }
+
+    event->remote = false;
+    for (size_t i = 0; i < NUM_URL_PREFIXES; i++) {
+        if (field_starts_with(event->path, URL_PREFIXES[i])) {
+            event->remote = true;
+            break;
+        }
+    }
+    return true;
+}
+
+// appends f to buffer at position len (truncating it to fit with a null byte)
+// returns the new length
+static size_t append_field(char *buffer, size_t len, size_t size, field f) {
+    size_t n = f.len < size - 1 - len ? f.len : size - 1 - len;
+    memcpy(buffer + len, f.ptr, n);
+    return len + n;
+}
+
+// writes the absolute, lexically normalized path of path (relative paths are
+// resolved against cwd) into buffer; URLs and paths relative to a directory fd
+// are copied as is
+// returns the length of the result
+size_t make_absolute_path(field cwd, field path, char *buffer, size_t size) {
+    char joined[8192];
+    size_t len = 0;
+    if (path.len > 0 && path.ptr[0] != '/' && cwd.len > 0 && cwd.ptr[0] == '/') {
+        len = append_field(joined, len, sizeof(joined), cwd);
+        len = append_field(joined, len, sizeof(joined), (field){"/", 1});
+    }
+    len = append_field(joined, len, sizeof(joined), path);
+    joined[len] = '\0';
+    if (joined[0] != '/') {
+        len = len < size - 1 ? len : size - 1;
+        memcpy(buffer, joined, len);
+        buffer[len] = '\0';
+        return len;
+    }
+
+    // remove empty and '.' components and resolve '..' components
+    size_t out = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && joined[i] == '/') {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && joined[i] != '/') {
+            i++;
+        }
+        size_t part_len = i - start;
+        if (part_len == 0 || (part_len == 1 && joined[start] == '.')) {
+            continue;
+        }
+        if (part_len == 2 && joined[start] == '.' && joined[start + 1] == '.') {
+            while (out > 0 && buffer[out - 1] != '/') {
+                out--;
+            }
+            if (out > 0) {
+                out--;
+            }
+            continue;
+        }
+        if (out + part_len + 2 > size) {
+            break;
+        }
+        buffer[out++] = '/';
+        memcpy(buffer + out, joined + start, part_len);
+        out += part_len;
+    }
+    if (out == 0) {
+        buffer[out++] = '/';
+    }
+    buffer[out] = '\0';
+    return out;
+}
+
+// writes a key identifying the process of a record into buffer:
+// 'PID<TAB>HOST<TAB>START_EPOCH<TAB>PROGRAM' (PIDs are only unique per host and
+// over time, hence the host and the start time of the process are included)
+size_t get_process_key(const log_record *record, char *buffer, size_t size) {
+    field host = record->columns[COL_HOST];
+    const char *end = memchr(host.ptr, '/', host.len);
+    if (end != NULL) {
+        host.len = end - host.ptr;
+    }
+    field start = record->columns[COL_START];
+    end = memchr(start.ptr, '%', start.len);
+    if (end != NULL) {
+        start.len = end - start.ptr;
+    }
+    field tab = {"\t", 1};
+    size_t len = append_field(buffer, 0, size, record->columns[COL_PID]);
+    len = append_field(buffer, len, size, tab);
+    len = append_field(buffer, len, size, host);
+    len = append_field(buffer, len, size, tab);
+    len = append_field(buffer, len, size, start);
+    len = append_field(buffer, len, size, tab);
+    len = append_field(buffer, len, size, record->columns[COL_PROGRAM]);
+    buffer[len] = '\0';
+    return len;
+}
+
+// time of a log line in microseconds since the epoch; the timestamp of column
+// 1 carries microseconds since the wrapper logs 'EPOCH.USEC::UTC', older logs
+// only resolve seconds so their lines are placed at start plus elapsed time
+int64_t get_record_time_us(const log_record *record) {
+    field time = record->columns[COL_TIME];
+    size_t i = 0;
+    while (i < time.len && time.ptr[i] >= '0' && time.ptr[i] <= '9') {
+        i++;
+    }
+    if (i < time.len && time.ptr[i] == '.') {
+        field fraction = {time.ptr + i + 1, time.len - i - 1};
+        return field_to_ll(time) * 1000000LL + field_to_ll(fraction);
+    }
+    return field_to_ll(record->columns[COL_START]) * 1000000LL + field_to_ll(record->columns[COL_ELAPSED]);
+}
@@ -0,0 +1,645 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// vdi trace replay: replays the opens recorded in the logs
+//
+// The logs record for each process the opens (path, access mode) and their
+// time since the start of the process (column 12), but neither the reads and
+// writes nor the threads. The replay turns each open into open, read of the
+// whole file (or writing --write-bytes) and close, and replays the opens of a
+// process in order by one worker thread, keeping their original spacing
+// (divided by --speed). Processes start at their original offsets, so
+// processes that ran concurrently are replayed concurrently.
+
+#define MAX_KEY_LEN 8192
+#define MAX_WORKERS 1024
+#define IO_BUFFER_SIZE (1024 * 1024)
+#define STRING_CONST_LIBVDI_FETCH "libvdi-fetch.so"
+#define ENVVAR_REPLAY_PRELOADED "VDI_REPLAY_PRELOADED"
+
+// paths that are not files of the workload
+static const char *SPECIAL_PREFIXES[] = {"/proc/", "/sys/", "/dev/"};
+static const size_t NUM_SPECIAL_PREFIXES = sizeof(SPECIAL_PREFIXES) / sizeof(SPECIAL_PREFIXES[0]);
+
+typedef struct {
+    int64_t time_us;   // time of the open (epoch, microseconds)
+    int access;        // ACCESS_READ and/or ACCESS_WRITE
+    bool remote;
+    char *path;        // absolute path or URL
+} replay_op;
+
+typedef struct {
+    replay_op *ops;
+    int num_ops;
+    int capacity;
+} replay_process;
+
+typedef struct {
+    const char *target;      // replay local paths under this directory
+    const char *strip;       // prefix removed from local paths before adding target
+    double speed;            // 0: as fast as possible
+    int concurrency;         // 0: one worker per process
+    int copies;              // replay each process this many times at once
+    long long read_bytes;    // -1: whole file
+    long long write_bytes;
+    bool remote;
+    char **patterns;
+    int num_patterns;
+} replay_options;
+
+// a growing array of latencies in microseconds
+typedef struct {
+    double *values;
+    size_t count;
+    size_t capacity;
+} samples;
+
+typedef struct {
+    samples open_us;         // open call
+    samples access_us;       // open, read or write and close
+    samples lag_us;          // start of an op after its scheduled time
+    long long opens;
+    long long reads;
+    long long writes;
+    long long remote;
+    long long errors;
+    long long not_found;
+    long long bytes_read;
+    long long bytes_written;
+} replay_stats;
+
+typedef struct {
+    const replay_options *options;
+    replay_process **queue;  // processes (each copies times) by start time
+    int queue_size;
+    int next;
+    pthread_mutex_t mutex;
+    int64_t first_us;        // time of the first op in the logs
+    struct timespec start;   // start of the replay
+    replay_stats *stats;     // one per worker
+} replay_state;
+
+static void add_sample(samples *s, double value) {
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity == 0 ? 1024 : 2 * s->capacity;
+        s->values = (double *)realloc(s->values, s->capacity * sizeof(double));
+    }
+    s->values[s->count++] = value;
+}
+
+static void merge_samples(samples *to, const samples *from) {
+    for (size_t i = 0; i < from->count; i++) {
+        add_sample(to, from->values[i]);
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const samples *s, double p) {
+    if (s->count == 0) {
+        return 0.0;
+    }
+    size_t i = (size_t)(p / 100.0 * (s->count - 1) + 0.5);
+    return s->values[i];
+}
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static bool is_special_path(const char *path) {
+    for (size_t i = 0; i < NUM_SPECIAL_PREFIXES; i++) {
+        if (strncmp(path, SPECIAL_PREFIXES[i], strlen(SPECIAL_PREFIXES[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool matches_patterns(const replay_options *options, const char *path) {
+    if (options->num_patterns == 0) {
+        return true;
+    }
+    for (int i = 0; i < options->num_patterns; i++) {
+        if (fnmatch(options->patterns[i], path, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    long long lines;
+    long long remote;
+    long long special;
+    long long relative;
+    long long unmatched;
+} skip_counts;
+
+// adds the opens of the log data to the processes (process key -> index)
+static void collect_ops(const char *data, size_t size, const replay_options *options, strmap *keys,
+                        replay_process **processes, int *num_processes, int *capacity, skip_counts *skipped) {
+    char key[MAX_KEY_LEN];
+    char path[MAX_KEY_LEN];
+    const char *end = data + size;
+    const char *line = data;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t len = newline == NULL ? (size_t)(end - line) : (size_t)(newline - line);
+        log_record record;
+        open_event event;
+        skipped->lines++;
+        if (split_record(line, len, &record) > COL_FIRST_ARG && parse_open_event(&record, &event)) {
+            make_absolute_path(record.columns[COL_CWD], event.path, path, sizeof(path));
+            if (event.remote && !options->remote) {
+                skipped->remote++;
+            } else if (!event.remote && path[0] != '/') {
+                skipped->relative++;     // relative to a directory fd
+            } else if (!event.remote && is_special_path(path)) {
+                skipped->special++;
+            } else if (!matches_patterns(options, path)) {
+                skipped->unmatched++;
+            } else {
+                size_t key_len = get_process_key(&record, key, sizeof(key));
+                int *index = (int *)strmap_find(keys, key, key_len);
+                if (index == NULL) {
+                    index = (int *)strmap_insert(keys, key, key_len);
+                    if (*num_processes == *capacity) {
+                        *capacity = *capacity == 0 ? 64 : 2 * *capacity;
+                        *processes = (replay_process *)realloc(*processes, *capacity * sizeof(replay_process));
+                    }
+                    memset(&(*processes)[*num_processes], 0, sizeof(replay_process));
+                    *index = (*num_processes)++;
+                }
+                replay_process *process = &(*processes)[*index];
+                if (process->num_ops == process->capacity) {
+                    process->capacity = process->capacity == 0 ? 16 : 2 * process->capacity;
+                    process->ops = (replay_op *)realloc(process->ops, process->capacity * sizeof(replay_op));
+                }
+                replay_op *op = &process->ops[process->num_ops++];
+                op->time_us = get_record_time_us(&record);
+                op->access = event.access;
+                op->remote = event.remote;
+                op->path = strdup(path);
+            }
+        }
+        line += len + 1;
+    }
+}
+
+static int compare_ops(const void *a, const void *b) {
+    const replay_op *x = (const replay_op *)a;
+    const replay_op *y = (const replay_op *)b;
+    return x->time_us < y->time_us ? -1 : x->time_us > y->time_us;
+}
+
+static int compare_processes(const void *a, const void *b) {
+    const replay_process *x = *(replay_process *const *)a;
+    const replay_process *y = *(replay_process *const *)b;
+    return x->ops[0].time_us < y->ops[0].time_us ? -1 : x->ops[0].time_us > y->ops[0].time_us;
+}
+
+// creates the parent directories of path
+static void create_parents(char *path) {
+    for (char *p = path + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, 0755);
+            *p = '/';
+        }
+    }
+}
+
+static void replay_op_now(const replay_options *options, const replay_op *op, char *buffer, replay_stats *stats) {
+    char path[PATH_MAX * 2];
+    const char *local = op->path;
+    if (!op->remote && options->strip != NULL && strncmp(local, options->strip, strlen(options->strip)) == 0) {
+        local += strlen(options->strip);
+    }
+    if (op->remote || options->target == NULL) {
+        snprintf(path, sizeof(path), "%s", op->path);
+    } else {
+        snprintf(path, sizeof(path), "%s%s%s", options->target, local[0] == '/' ? "" : "/", local);
+    }
+    bool writing = (op->access & ACCESS_WRITE) != 0;
+    int flags = writing ? ((op->access & ACCESS_READ) ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC : O_RDONLY;
+    if (writing) {
+        create_parents(path);
+    }
+
+    struct timespec t0, t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->opens++;
+    stats->remote += op->remote;
+    if (fd == -1) {
+        stats->errors++;
+        stats->not_found += errno == ENOENT;
+        return;
+    }
+    add_sample(&stats->open_us, elapsed_us(&t0, &t1));
+    if (writing) {
+        stats->writes++;
+        long long remaining = options->write_bytes;
+        while (remaining > 0) {
+            ssize_t n = write(fd, buffer, remaining < IO_BUFFER_SIZE ? remaining : IO_BUFFER_SIZE);
+            if (n <= 0) {
+                stats->errors++;
+                break;
+            }
+            stats->bytes_written += n;
+            remaining -= n;
+        }
+    } else {
+        stats->reads++;
+        long long remaining = options->read_bytes < 0 ? LLONG_MAX : options->read_bytes;
+        while (remaining > 0) {
+            ssize_t n = read(fd, buffer, remaining < IO_BUFFER_SIZE ? remaining : IO_BUFFER_SIZE);
+            if (n <= 0) {
+                stats->errors += n < 0;
+                break;
+            }
+            stats->bytes_read += n;
+            remaining -= n;
+        }
+    }
+    close(fd);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    add_sample(&stats->access_us, elapsed_us(&t0, &t2));
+}
+
+// waits until time_us of the logs is due in the replay; returns how late it is
+static double wait_for(const replay_state *state, int64_t time_us) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (state->options->speed <= 0) {
+        return 0.0;
+    }
+    double due_us = (time_us - state->first_us) / state->options->speed;
+    double late_us = elapsed_us(&state->start, &now) - due_us;
+    if (late_us >= 0) {
+        return late_us;
+    }
+    long long due_ns = (long long)(due_us * 1000.0);
+    struct timespec due = state->start;
+    due.tv_sec += due_ns / 1000000000LL;
+    due.tv_nsec += due_ns % 1000000000LL;
+    if (due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+    }
+    return 0.0;
+}
+
+typedef struct {
+    replay_state *state;
+    int worker;
+} worker_args;
+
+static void *replay_worker(void *arg) {
+    worker_args *args = (worker_args *)arg;
+    replay_state *state = args->state;
+    replay_stats *stats = &state->stats[args->worker];
+    char *buffer = (char *)calloc(1, IO_BUFFER_SIZE);
+    while (true) {
+        pthread_mutex_lock(&state->mutex);
+        int i = state->next < state->queue_size ? state->next++ : -1;
+        pthread_mutex_unlock(&state->mutex);
+        if (i == -1) {
+            break;
+        }
+        const replay_process *process = state->queue[i];
+        for (int j = 0; j < process->num_ops; j++) {
+            double late_us = wait_for(state, process->ops[j].time_us);
+            if (state->options->speed > 0) {
+                add_sample(&stats->lag_us, late_us);
+            }
+            replay_op_now(state->options, &process->ops[j], buffer, stats);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void print_latencies(const char *name, samples *s) {
+    qsort(s->values, s->count, sizeof(double), compare_doubles);
+    printf("  %-16s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", name, s->count, percentile(s, 50),
+           percentile(s, 90), percentile(s, 99), percentile(s, 99.9), s->count > 0 ? s->values[s->count - 1] : 0.0);
+}
+
+static void print_json_latencies(const char *name, samples *s, bool last) {
+    qsort(s->values, s->count, sizeof(double), compare_doubles);
+    printf("    \"%s\": {\"count\": %zu, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n",
+           name, s->count, percentile(s, 50), percentile(s, 90), percentile(s, 99), percentile(s, 99.9),
+           s->count > 0 ? s->values[s->count - 1] : 0.0, last ? "" : ",");
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace replay [OPTIONS] [LOG_FILE|LOG_DIR ...]\n");
+    fprintf(out, "Replays the opens recorded in the logs of libvdi.so to benchmark file systems and\n");
+    fprintf(out, "caches with the I/O pattern of a workload. Each open becomes open, read of the\n");
+    fprintf(out, "whole file (or write) and close; the opens of a process are replayed in order\n");
+    fprintf(out, "with their original spacing, processes start at their original offsets.\n");
+    fprintf(out, "Without arguments the log directory ($VDI_LOG_DIR or $HOME/.vdi/logs) is used.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --target DIR        replay local paths under DIR (DIR/PATH); without it, reads use\n");
+    fprintf(out, "                      the original paths and writes are skipped\n");
+    fprintf(out, "  --strip PREFIX      remove PREFIX from local paths before adding DIR\n");
+    fprintf(out, "  --speed X           replay X times faster than recorded (default: 1), 'max':\n");
+    fprintf(out, "                      as fast as possible\n");
+    fprintf(out, "  -c, --concurrency N at most N processes at once (default: 0, all as recorded,\n");
+    fprintf(out, "                      up to %d)\n", MAX_WORKERS);
+    fprintf(out, "  --copies K          replay each process K times at once (default: 1)\n");
+    fprintf(out, "  --read-bytes SIZE   read at most SIZE bytes per open (default: whole file)\n");
+    fprintf(out, "  --write-bytes SIZE  write SIZE bytes per open for writing (default: 0)\n");
+    fprintf(out, "  --match PATTERN     replay only paths matching the shell pattern (repeatable)\n");
+    fprintf(out, "  --remote            replay opens of URLs and vdi:// paths through libvdi.so\n");
+    fprintf(out, "                      (" STRING_CONST_LIBVDI_FETCH ", which downloads them)\n");
+    fprintf(out, "  --libvdi PATH       library for --remote (default: lib64/" STRING_CONST_LIBVDI_FETCH
+            " next to bin/)\n");
+    fprintf(out, "  --json              print the results as JSON\n");
+    fprintf(out, "  -h, --help          show this help\n");
+}
+
+// restarts vdi-trace with libvdi.so preloaded, so that the opens of URLs and
+// vdi:// paths take the same path as in the traced programs
+static int reexec_with_libvdi(const char *libvdi, int argc, char **argv) {
+    char path[PATH_MAX + 32];
+    if (libvdi == NULL) {
+        char exe[PATH_MAX];
+        ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (n <= 0) {
+            return -1;
+        }
+        exe[n] = '\0';
+        char *slash = strrchr(exe, '/');
+        *slash = '\0';
+        snprintf(path, sizeof(path), "%s/../lib64/%s", exe, STRING_CONST_LIBVDI_FETCH);
+        libvdi = path;
+    }
+    if (access(libvdi, R_OK) != 0) {
+        fprintf(stderr, "vdi-trace: --remote needs '%s' (see --libvdi)\n", libvdi);
+        return -1;
+    }
+    setenv("LD_PRELOAD", libvdi, 1);
+    setenv(ENVVAR_REPLAY_PRELOADED, "1", 1);
+    char **args = (char **)calloc(argc + 2, sizeof(char *));
+    args[0] = "vdi-trace";
+    for (int i = 0; i < argc; i++) {
+        args[i + 1] = argv[i];
+    }
+    execv("/proc/self/exe", args);
+    fprintf(stderr, "vdi-trace: cannot restart with '%s': %s\n", libvdi, strerror(errno));
+    free(args);
+    return -1;
+}
+
+static long long parse_bytes(const char *value) {
+    char *end;
+    long long size = strtoll(value, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size *= 1024LL; break;
+        case 'm': case 'M': size *= 1024LL * 1024; break;
+        case 'g': case 'G': size *= 1024LL * 1024 * 1024; break;
+    }
+    return size;
+}
+
+int replay_main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"target", required_argument, NULL, 'T'},
+        {"strip", required_argument, NULL, 's'},
+        {"speed", required_argument, NULL, 'S'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"copies", required_argument, NULL, 'k'},
+        {"read-bytes", required_argument, NULL, 'r'},
+        {"write-bytes", required_argument, NULL, 'w'},
+        {"match", required_argument, NULL, 'm'},
+        {"remote", no_argument, NULL, 'R'},
+        {"libvdi", required_argument, NULL, 'L'},
+        {"json", no_argument, NULL, 'J'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    replay_options options;
+    memset(&options, 0, sizeof(options));
+    options.speed = 1.0;
+    options.copies = 1;
+    options.read_bytes = -1;
+    options.patterns = (char **)calloc(argc + 1, sizeof(char *));
+    const char *libvdi = NULL;
+    bool json = false;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "c:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'T': options.target = optarg; break;
+            case 's': options.strip = optarg; break;
+            case 'S': options.speed = strcmp(optarg, "max") == 0 ? 0.0 : atof(optarg); break;
+            case 'c': options.concurrency = atoi(optarg); break;
+            case 'k': options.copies = atoi(optarg); break;
+            case 'r': options.read_bytes = parse_bytes(optarg); break;
+            case 'w': options.write_bytes = parse_bytes(optarg); break;
+            case 'm': options.patterns[options.num_patterns++] = optarg; break;
+            case 'R': options.remote = true; break;
+            case 'L': libvdi = optarg; break;
+            case 'J': json = true; break;
+            case 'h': usage(stdout); free(options.patterns); return EXIT_SUCCESS;
+            default: usage(stderr); free(options.patterns); return EXIT_FAILURE;
+        }
+    }
+    if (options.speed < 0 || options.concurrency < 0 || options.copies < 1) {
+        usage(stderr);
+        free(options.patterns);
+        return EXIT_FAILURE;
+    }
+    if (options.remote && getenv(ENVVAR_REPLAY_PRELOADED) == NULL) {
+        reexec_with_libvdi(libvdi, argc, argv);
+        free(options.patterns);
+        return EXIT_FAILURE;
+    }
+
+    char **paths;
+    int num_paths = collect_log_files(argc - optind, argv + optind, &paths);
+    if (num_paths < 0) {
+        free(options.patterns);
+        return EXIT_FAILURE;
+    }
+    strmap *keys = strmap_create(sizeof(int));
+    replay_process *processes = NULL;
+    int num_processes = 0;
+    int capacity = 0;
+    skip_counts skipped;
+    memset(&skipped, 0, sizeof(skipped));
+    for (int i = 0; i < num_paths; i++) {
+        log_file file;
+        if (log_file_open(paths[i], &file) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+        } else {
+            if (decompress_log_file(&file) == 0) {
+                collect_ops(file.data, file.size, &options, keys, &processes, &num_processes, &capacity, &skipped);
+            }
+            log_file_close(&file);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    strmap_free(keys);
+
+    // without a target directory, writes would change the original files
+    long long skipped_writes = 0;
+    long long num_ops = 0;
+    int64_t first_us = INT64_MAX;
+    for (int i = 0; i < num_processes; i++) {
+        replay_process *process = &processes[i];
+        int n = 0;
+        for (int j = 0; j < process->num_ops; j++) {
+            if (options.target == NULL && !process->ops[j].remote && (process->ops[j].access & ACCESS_WRITE)) {
+                skipped_writes++;
+                free(process->ops[j].path);
+            } else {
+                process->ops[n++] = process->ops[j];
+            }
+        }
+        process->num_ops = n;
+        qsort(process->ops, n, sizeof(replay_op), compare_ops);
+        num_ops += n;
+        if (n > 0 && process->ops[0].time_us < first_us) {
+            first_us = process->ops[0].time_us;
+        }
+    }
+
+    replay_state state;
+    memset(&state, 0, sizeof(state));
+    state.options = &options;
+    state.first_us = first_us;
+    state.queue = (replay_process **)malloc(((size_t)num_processes * options.copies + 1) * sizeof(replay_process *));
+    for (int i = 0; i < num_processes; i++) {
+        for (int k = 0; k < options.copies && processes[i].num_ops > 0; k++) {
+            state.queue[state.queue_size++] = &processes[i];
+        }
+    }
+    qsort(state.queue, state.queue_size, sizeof(replay_process *), compare_processes);
+    pthread_mutex_init(&state.mutex, NULL);
+    int num_workers = options.concurrency > 0 ? options.concurrency : state.queue_size;
+    if (num_workers > state.queue_size) {
+        num_workers = state.queue_size;
+    }
+    if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+    state.stats = (replay_stats *)calloc(num_workers + 1, sizeof(replay_stats));
+    pthread_t *threads = (pthread_t *)malloc((num_workers + 1) * sizeof(pthread_t));
+    worker_args *args = (worker_args *)malloc((num_workers + 1) * sizeof(worker_args));
+
+    clock_gettime(CLOCK_MONOTONIC, &state.start);
+    for (int w = 0; w < num_workers; w++) {
+        args[w].state = &state;
+        args[w].worker = w;
+        pthread_create(&threads[w], NULL, replay_worker, &args[w]);
+    }
+    for (int w = 0; w < num_workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed_us(&state.start, &end) / 1e6;
+
+    replay_stats total;
+    memset(&total, 0, sizeof(total));
+    for (int w = 0; w < num_workers; w++) {
+        replay_stats *s = &state.stats[w];
+        merge_samples(&total.open_us, &s->open_us);
+        merge_samples(&total.access_us, &s->access_us);
+        merge_samples(&total.lag_us, &s->lag_us);
+        total.opens += s->opens;
+        total.reads += s->reads;
+        total.writes += s->writes;
+        total.remote += s->remote;
+        total.errors += s->errors;
+        total.not_found += s->not_found;
+        total.bytes_read += s->bytes_read;
+        total.bytes_written += s->bytes_written;
+        free(s->open_us.values);
+        free(s->access_us.values);
+        free(s->lag_us.values);
+    }
+
+    double per_second = seconds > 0 ? 1.0 / seconds : 0.0;
+    if (json) {
+        printf("{\n  \"processes\": %d,\n  \"copies\": %d,\n  \"workers\": %d,\n", num_processes, options.copies, num_workers);
+        printf("  \"speed\": %.3f,\n  \"seconds\": %.3f,\n", options.speed, seconds);
+        printf("  \"opens\": %lld,\n  \"reads\": %lld,\n  \"writes\": %lld,\n  \"remote\": %lld,\n",
+               total.opens, total.reads, total.writes, total.remote);
+        printf("  \"errors\": %lld,\n  \"not_found\": %lld,\n", total.errors, total.not_found);
+        printf("  \"bytes_read\": %lld,\n  \"bytes_written\": %lld,\n", total.bytes_read, total.bytes_written);
+        printf("  \"opens_per_second\": %.1f,\n  \"read_bytes_per_second\": %.0f,\n  \"write_bytes_per_second\": %.0f,\n",
+               total.opens * per_second, total.bytes_read * per_second, total.bytes_written * per_second);
+        printf("  \"skipped\": {\"remote\": %lld, \"writes\": %lld, \"special\": %lld, \"relative\": %lld, \"unmatched\": %lld},\n",
+               skipped.remote, skipped_writes, skipped.special, skipped.relative, skipped.unmatched);
+        printf("  \"latency_us\": {\n");
+        print_json_latencies("open", &total.open_us, false);
+        print_json_latencies("access", &total.access_us, false);
+        print_json_latencies("lag", &total.lag_us, true);
+        printf("  }\n}\n");
+    } else {
+        char buffer[3][32];
+        printf("replayed %lld opens of %d processes (x%d) with %d workers in %.2f s",
+               total.opens, num_processes, options.copies, num_workers, seconds);
+        if (options.speed > 0) {
+            printf(" (speed %gx)\n", options.speed);
+        } else {
+            printf(" (as fast as possible)\n");
+        }
+        printf("  reads: %lld, writes: %lld, remote: %lld, errors: %lld (not found: %lld)\n",
+               total.reads, total.writes, total.remote, total.errors, total.not_found);
+        printf("  skipped: %lld remote, %lld writes (no --target), %lld in /proc, /sys or /dev, "
+               "%lld relative to a directory fd, %lld not matching\n",
+               skipped.remote, skipped_writes, skipped.special, skipped.relative, skipped.unmatched);
+        printf("  throughput: %.1f opens/s, read %s/s (%s), written %s/s\n", total.opens * per_second,
+               format_bytes(total.bytes_read * per_second, buffer[0], sizeof(buffer[0])),
+               format_bytes(total.bytes_read, buffer[1], sizeof(buffer[1])),
+               format_bytes(total.bytes_written * per_second, buffer[2], sizeof(buffer[2])));
+        printf("\nlatency (us)            count        p50        p90        p99      p99.9        max\n");
+        print_latencies("open", &total.open_us);
+        print_latencies("open+io+close", &total.access_us);
+        if (options.speed > 0) {
+            print_latencies("lag (schedule)", &total.lag_us);
+        }
+    }
+
+    free(total.open_us.values);
+    free(total.access_us.values);
+    free(total.lag_us.values);
+    for (int i = 0; i < num_processes; i++) {
+        for (int j = 0; j < processes[i].num_ops; j++) {
+            free(processes[i].ops[j].path);
+        }
+        free(processes[i].ops);
+    }
+    free(processes);
+    free(state.queue);
+    free(state.stats);
+    free(threads);
+    free(args);
+    free(options.patterns);
+    pthread_mutex_destroy(&state.mutex);
+    return total.errors > 0 && total.errors == total.opens ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,669 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define DEFAULT_TOP 20
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_KEY_LEN 8192
+
+typedef struct {
+    long long opens;
+    long long reads;
+    long long writes;
+    bool remote;
+} file_stats;
+
+typedef struct {
+    long long processes;
+    long long calls;
+    long long opens;
+    long long reads;
+    long long writes;
+    long long remote;
+} program_stats;
+
+typedef struct {
+    long long calls;
+} process_stats;
+
+typedef struct {
+    int access;
+} io_stats;
+
+typedef struct {
+    long long count;
+    long long unlogged;  // not logged because of sampling (see 'vdi_counters')
+} counter;
+
+// results of one thread, merged into the results of thread 0 at the end
+typedef struct {
+    strmap *files;       // absolute path or URL -> file_stats
+    strmap *programs;    // program -> program_stats
+    strmap *processes;   // process key (see get_process_key) -> process_stats
+    strmap *io;          // process key '\n' path -> io_stats
+    strmap *functions;   // function name -> counter
+    long long lines;
+    long long malformed;
+    long long sampled_processes; // processes that logged 'vdi_sampling'
+    long long remote_opens;
+    long long uploads_ok;
+    long long uploads_failed;
+    long long downloads_ok;
+    long long downloads_failed;
+    long long download_bytes_received; // on the wire, possibly compressed
+    long long download_bytes_stored;   // after decoding and decompression
+} summary;
+
+static summary *summary_create(void) {
+    summary *s = (summary *)calloc(1, sizeof(summary));
+    s->files = strmap_create(sizeof(file_stats));
+    s->programs = strmap_create(sizeof(program_stats));
+    s->processes = strmap_create(sizeof(process_stats));
+    s->io = strmap_create(sizeof(io_stats));
+    s->functions = strmap_create(sizeof(counter));
+    return s;
+}
+
+static void summary_free(summary *s) {
+    strmap_free(s->files);
+    strmap_free(s->programs);
+    strmap_free(s->processes);
+    strmap_free(s->io);
+    strmap_free(s->functions);
+    free(s);
+}
+
+// adds the calls that libvdi.so did not log because of sampling, counted as
+// 'FUNC.path_limited=N', 'FUNC.sampled_out=N' and 'FUNC.rate_limited=N' in
+// the arguments of 'vdi_counters' (the last column holds all of them)
+static void add_unlogged_counts(summary *s, const log_record *record) {
+    static const char *suffixes[] = { ".path_limited=", ".sampled_out=", ".rate_limited=" };
+    const field *last = &record->columns[record->num_columns - 1];
+    const char *ptr = record->columns[COL_FIRST_ARG].ptr;
+    const char *end = last->ptr + last->len;
+    while (ptr < end) {
+        const char *arg_end = memchr(ptr, ' ', end - ptr);
+        if (arg_end == NULL) {
+            arg_end = end;
+        }
+        for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+            size_t suffix_len = strlen(suffixes[i]);
+            const char *suffix = memmem(ptr, arg_end - ptr, suffixes[i], suffix_len);
+            if (suffix != NULL) {
+                field count = {suffix + suffix_len, arg_end - suffix - suffix_len};
+                ((counter *)strmap_insert(s->functions, ptr, suffix - ptr))->unlogged += field_to_ll(count);
+                break;
+            }
+        }
+        ptr = arg_end + 1;
+    }
+}
+
+static void add_record(summary *s, const log_record *record) {
+    field func = record->columns[COL_FUNC];
+    ((counter *)strmap_insert(s->functions, func.ptr, func.len))->count++;
+
+    char process_key[MAX_KEY_LEN];
+    size_t process_key_len = get_process_key(record, process_key, sizeof(process_key));
+    ((process_stats *)strmap_insert(s->processes, process_key, process_key_len))->calls++;
+
+    field program = record->columns[COL_PROGRAM];
+    program_stats *program_entry = (program_stats *)strmap_insert(s->programs, program.ptr, program.len);
+    program_entry->calls++;
+
+    if (field_equals(func, "vdi_sampling")) {
+        s->sampled_processes++;
+        return;
+    }
+    if (field_equals(func, "vdi_counters") && record->num_columns > COL_FIRST_ARG) {
+        add_unlogged_counts(s, record);
+        return;
+    }
+    if (field_equals(func, "vdi_publish") && record->num_columns > COL_FIRST_ARG + 2) {
+        if (field_equals(record->columns[COL_FIRST_ARG + 2], "OK")) {
+            s->uploads_ok++;
+        } else {
+            s->uploads_failed++;
+        }
+        return;
+    }
+    if (field_equals(func, "vdi_download") && record->num_columns > COL_FIRST_ARG + 5) {
+        if (field_equals(record->columns[COL_FIRST_ARG + 5], "OK")) {
+            s->downloads_ok++;
+            s->download_bytes_received += field_to_ll(record->columns[COL_FIRST_ARG + 3]);
+            s->download_bytes_stored += field_to_ll(record->columns[COL_FIRST_ARG + 4]);
+        } else {
+            s->downloads_failed++;
+        }
+        return;
+    }
+
+    open_event event;
+    if (!parse_open_event(record, &event)) {
+        return;
+    }
+
+    // the io key is 'PROCESS_KEY\nPATH', the path is absolute unless it is a
+    // URL or relative to a directory fd
+    char io_key[MAX_KEY_LEN];
+    memcpy(io_key, process_key, process_key_len);
+    io_key[process_key_len] = '\n';
+    char *path = io_key + process_key_len + 1;
+    size_t path_size = sizeof(io_key) - process_key_len - 1;
+    size_t path_len;
+    if (event.remote || event.dirfd != AT_FDCWD) {
+        field no_cwd = {"", 0};
+        path_len = make_absolute_path(no_cwd, event.path, path, path_size);
+    } else {
+        path_len = make_absolute_path(record->columns[COL_CWD], event.path, path, path_size);
+    }
+    ((io_stats *)strmap_insert(s->io, io_key, process_key_len + 1 + path_len))->access |= event.access;
+
+    file_stats *file_entry = (file_stats *)strmap_insert(s->files, path, path_len);
+    file_entry->opens++;
+    program_entry->opens++;
+    if (event.access & ACCESS_READ) {
+        file_entry->reads++;
+        program_entry->reads++;
+    }
+    if (event.access & ACCESS_WRITE) {
+        file_entry->writes++;
+        program_entry->writes++;
+    }
+    if (event.remote) {
+        file_entry->remote = true;
+        program_entry->remote++;
+        s->remote_opens++;
+    }
+}
+
+// processes all lines of a chunk, lines are found with memchr (vectorized in
+// glibc) and split into columns with split_record
+static void summarize_chunk(void *state, const log_chunk *chunk) {
+    summary *s = (summary *)state;
+    const char *ptr = chunk->data;
+    const char *end = chunk->data + chunk->size;
+    log_record record;
+    while (ptr < end) {
+        const char *newline = memchr(ptr, '\n', end - ptr);
+        const char *line_end = newline == NULL ? end : newline;
+        size_t len = line_end - ptr;
+        if (len > 0) {
+            s->lines++;
+            if (split_record(ptr, len, &record) <= COL_FUNC) {
+                s->malformed++;
+            } else {
+                add_record(s, &record);
+            }
+        }
+        ptr = line_end + 1;
+    }
+}
+
+static void merge_summary(summary *into, const summary *from) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(from->files); i++) {
+        file_stats *value = (file_stats *)strmap_slot(from->files, i, &key, &len);
+        if (value != NULL) {
+            file_stats *entry = (file_stats *)strmap_insert(into->files, key, len);
+            entry->opens += value->opens;
+            entry->reads += value->reads;
+            entry->writes += value->writes;
+            entry->remote |= value->remote;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(from->programs); i++) {
+        program_stats *value = (program_stats *)strmap_slot(from->programs, i, &key, &len);
+        if (value != NULL) {
+            program_stats *entry = (program_stats *)strmap_insert(into->programs, key, len);
+            entry->calls += value->calls;
+            entry->opens += value->opens;
+            entry->reads += value->reads;
+            entry->writes += value->writes;
+            entry->remote += value->remote;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(from->processes); i++) {
+        process_stats *value = (process_stats *)strmap_slot(from->processes, i, &key, &len);
+        if (value != NULL) {
+            ((process_stats *)strmap_insert(into->processes, key, len))->calls += value->calls;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(from->io); i++) {
+        io_stats *value = (io_stats *)strmap_slot(from->io, i, &key, &len);
+        if (value != NULL) {
+            ((io_stats *)strmap_insert(into->io, key, len))->access |= value->access;
+        }
+    }
+    for (size_t i = 0; i < strmap_capacity(from->functions); i++) {
+        counter *value = (counter *)strmap_slot(from->functions, i, &key, &len);
+        if (value != NULL) {
+            counter *entry = (counter *)strmap_insert(into->functions, key, len);
+            entry->count += value->count;
+            entry->unlogged += value->unlogged;
+        }
+    }
+    into->lines += from->lines;
+    into->malformed += from->malformed;
+    into->sampled_processes += from->sampled_processes;
+    into->remote_opens += from->remote_opens;
+    into->uploads_ok += from->uploads_ok;
+    into->uploads_failed += from->uploads_failed;
+    into->downloads_ok += from->downloads_ok;
+    into->downloads_failed += from->downloads_failed;
+    into->download_bytes_received += from->download_bytes_received;
+    into->download_bytes_stored += from->download_bytes_stored;
+}
+
+// the program is the last tab-separated field of a process key
+static field get_program_of_process_key(const char *key, size_t len) {
+    field program = {key, len};
+    const char *tab = memrchr(key, '\t', len);
+    if (tab != NULL) {
+        program.ptr = tab + 1;
+        program.len = len - (tab + 1 - key);
+    }
+    return program;
+}
+
+static void count_processes_per_program(summary *s) {
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(s->processes); i++) {
+        if (strmap_slot(s->processes, i, &key, &len) != NULL) {
+            field program = get_program_of_process_key(key, len);
+            ((program_stats *)strmap_insert(s->programs, program.ptr, program.len))->processes++;
+        }
+    }
+}
+
+// aggregates the opens of local files per directory
+static strmap *get_directories(const summary *s) {
+    strmap *directories = strmap_create(sizeof(file_stats));
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(s->files); i++) {
+        file_stats *value = (file_stats *)strmap_slot(s->files, i, &key, &len);
+        if (value == NULL || value->remote || len == 0 || key[0] != '/') {
+            continue;
+        }
+        const char *slash = memrchr(key, '/', len);
+        size_t dir_len = slash == key ? 1 : (size_t)(slash - key);
+        file_stats *entry = (file_stats *)strmap_insert(directories, key, dir_len);
+        entry->opens += value->opens;
+        entry->reads += value->reads;
+        entry->writes += value->writes;
+    }
+    return directories;
+}
+
+static int compare_files_by_opens(const void *a, const void *b) {
+    const file_stats *x = (const file_stats *)((const map_entry *)a)->value;
+    const file_stats *y = (const file_stats *)((const map_entry *)b)->value;
+    if (x->opens != y->opens) {
+        return x->opens < y->opens ? 1 : -1;
+    }
+    return compare_entries_by_key(a, b);
+}
+
+static int compare_programs_by_opens(const void *a, const void *b) {
+    const program_stats *x = (const program_stats *)((const map_entry *)a)->value;
+    const program_stats *y = (const program_stats *)((const map_entry *)b)->value;
+    if (x->opens != y->opens) {
+        return x->opens < y->opens ? 1 : -1;
+    }
+    return compare_entries_by_key(a, b);
+}
+
+static int compare_counters(const void *a, const void *b) {
+    const counter *x = (const counter *)((const map_entry *)a)->value;
+    const counter *y = (const counter *)((const map_entry *)b)->value;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return compare_entries_by_key(a, b);
+}
+
+static size_t limit(size_t size, int top) {
+    return top > 0 && (size_t)top < size ? (size_t)top : size;
+}
+
+static void print_table(const summary *s, int top, int num_files, size_t bytes, double seconds) {
+    char buffer[64];
+    printf("Processed %d log file(s), %s, %lld lines (%lld malformed) in %.2f s (%s/s)\n",
+           num_files, format_bytes(bytes, buffer, sizeof(buffer)), s->lines, s->malformed, seconds,
+           format_bytes(seconds > 0 ? bytes / seconds : 0, buffer + 32, sizeof(buffer) - 32));
+    printf("Processes: %zu, programs: %zu, files: %zu\n",
+           strmap_size(s->processes), strmap_size(s->programs), strmap_size(s->files));
+
+    map_entry *entries = get_sorted_entries(s->functions, compare_counters);
+    if (s->sampled_processes == 0) {
+        printf("\nFunctions\n%12s  %s\n", "CALLS", "FUNCTION");
+        for (size_t i = 0; i < strmap_size(s->functions); i++) {
+            printf("%12lld  %.*s\n", ((counter *)entries[i].value)->count, (int)entries[i].len, entries[i].key);
+        }
+    } else {
+        // the counts of files, programs and processes below are those of the logged calls
+        printf("\nFunctions (%lld process(es) logged a sample of their calls)\n%12s %12s %12s  %s\n",
+               s->sampled_processes, "LOGGED", "UNLOGGED", "TOTAL", "FUNCTION");
+        for (size_t i = 0; i < strmap_size(s->functions); i++) {
+            const counter *c = (const counter *)entries[i].value;
+            printf("%12lld %12lld %12lld  %.*s\n", c->count, c->unlogged, c->count + c->unlogged,
+                   (int)entries[i].len, entries[i].key);
+        }
+    }
+    free(entries);
+
+    printf("\nFiles (top %zu of %zu by opens)\n%10s %10s %10s  %s\n", limit(strmap_size(s->files), top),
+           strmap_size(s->files), "OPENS", "READS", "WRITES", "PATH");
+    entries = get_sorted_entries(s->files, compare_files_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(s->files), top); i++) {
+        file_stats *f = (file_stats *)entries[i].value;
+        printf("%10lld %10lld %10lld  %.*s\n", f->opens, f->reads, f->writes, (int)entries[i].len, entries[i].key);
+    }
+    free(entries);
+
+    strmap *directories = get_directories(s);
+    printf("\nDirectories (top %zu of %zu by opens)\n%10s %10s %10s  %s\n", limit(strmap_size(directories), top),
+           strmap_size(directories), "OPENS", "READS", "WRITES", "DIRECTORY");
+    entries = get_sorted_entries(directories, compare_files_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(directories), top); i++) {
+        file_stats *f = (file_stats *)entries[i].value;
+        printf("%10lld %10lld %10lld  %.*s\n", f->opens, f->reads, f->writes, (int)entries[i].len, entries[i].key);
+    }
+    free(entries);
+    strmap_free(directories);
+
+    printf("\nPrograms (top %zu of %zu by opens)\n%10s %10s %10s %10s %10s %10s  %s\n",
+           limit(strmap_size(s->programs), top), strmap_size(s->programs),
+           "PROCESSES", "CALLS", "OPENS", "READS", "WRITES", "REMOTE", "PROGRAM");
+    entries = get_sorted_entries(s->programs, compare_programs_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(s->programs), top); i++) {
+        program_stats *p = (program_stats *)entries[i].value;
+        printf("%10lld %10lld %10lld %10lld %10lld %10lld  %.*s\n", p->processes, p->calls, p->opens,
+               p->reads, p->writes, p->remote, (int)entries[i].len, entries[i].key);
+    }
+    free(entries);
+
+    size_t remote_files = 0;
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(s->files); i++) {
+        file_stats *f = (file_stats *)strmap_slot(s->files, i, &key, &len);
+        if (f != NULL && f->remote) {
+            remote_files++;
+        }
+    }
+    printf("\nRemote fetches\n  opens of URLs and vdi:// paths: %lld (%zu distinct)\n", s->remote_opens, remote_files);
+    printf("  uploads (vdi_publish): %lld ok, %lld failed\n", s->uploads_ok, s->uploads_failed);
+    printf("  downloads (vdi_download): %lld ok, %lld failed, %lld bytes received, %lld bytes stored\n",
+           s->downloads_ok, s->downloads_failed, s->download_bytes_received, s->download_bytes_stored);
+
+    // the io keys sort by process first, so the files of a process are adjacent
+    printf("\nInputs and outputs per process (PID HOST START PROGRAM, 'r' input, 'w' output)\n");
+    entries = get_sorted_entries(s->io, compare_entries_by_key);
+    size_t num_processes = 0;
+    const char *last_process = NULL;
+    size_t last_process_len = 0;
+    for (size_t i = 0; i < strmap_size(s->io); i++) {
+        const char *newline = memchr(entries[i].key, '\n', entries[i].len);
+        size_t process_len = newline - entries[i].key;
+        if (last_process == NULL || process_len != last_process_len ||
+            memcmp(last_process, entries[i].key, process_len) != 0) {
+            last_process = entries[i].key;
+            last_process_len = process_len;
+            if (top > 0 && ++num_processes > (size_t)top) {
+                printf("  ... (use --top 0 to show all processes)\n");
+                break;
+            }
+            printf("  ");
+            for (size_t j = 0; j < process_len; j++) {
+                putchar(entries[i].key[j] == '\t' ? ' ' : entries[i].key[j]);
+            }
+            putchar('\n');
+        }
+        int access = ((io_stats *)entries[i].value)->access;
+        printf("    %c%c %.*s\n", access & ACCESS_READ ? 'r' : '-', access & ACCESS_WRITE ? 'w' : '-',
+               (int)(entries[i].len - process_len - 1), newline + 1);
+    }
+    free(entries);
+}
+
+static void print_json_counts(const file_stats *f) {
+    printf("\"opens\": %lld, \"reads\": %lld, \"writes\": %lld", f->opens, f->reads, f->writes);
+}
+
+static void print_json_process(const char *key, size_t len) {
+    const char *names[] = {"pid", "host", "start", "program"};
+    const char *ptr = key;
+    const char *end = key + len;
+    for (int i = 0; i < 4; i++) {
+        const char *tab = i < 3 ? memchr(ptr, '\t', end - ptr) : NULL;
+        const char *field_end = tab == NULL ? end : tab;
+        printf("%s\"%s\": ", i == 0 ? "" : ", ", names[i]);
+        if ((i == 0 || i == 2) && field_end > ptr) {
+            printf("%.*s", (int)(field_end - ptr), ptr);
+        } else {
+            print_json_string(stdout, ptr, field_end - ptr);
+        }
+        ptr = tab == NULL ? end : tab + 1;
+    }
+}
+
+static void print_json(const summary *s, int top, int num_files, size_t bytes, double seconds) {
+    printf("{\n  \"summary\": {\"log_files\": %d, \"bytes\": %zu, \"lines\": %lld, \"malformed\": %lld, "
+           "\"seconds\": %.3f, \"processes\": %zu, \"programs\": %zu, \"files\": %zu},\n",
+           num_files, bytes, s->lines, s->malformed, seconds,
+           strmap_size(s->processes), strmap_size(s->programs), strmap_size(s->files));
+
+    printf("  \"functions\": {");
+    map_entry *entries = get_sorted_entries(s->functions, compare_counters);
+    for (size_t i = 0; i < strmap_size(s->functions); i++) {
+        printf("%s", i == 0 ? "" : ", ");
+        print_json_string(stdout, entries[i].key, entries[i].len);
+        printf(": %lld", ((counter *)entries[i].value)->count);
+    }
+    printf("},\n");
+    if (s->sampled_processes > 0) {
+        printf("  \"sampling\": {\"processes\": %lld, \"unlogged\": {", s->sampled_processes);
+        for (size_t i = 0, n = 0; i < strmap_size(s->functions); i++) {
+            if (((counter *)entries[i].value)->unlogged > 0) {
+                printf("%s", n++ == 0 ? "" : ", ");
+                print_json_string(stdout, entries[i].key, entries[i].len);
+                printf(": %lld", ((counter *)entries[i].value)->unlogged);
+            }
+        }
+        printf("}},\n");
+    }
+    free(entries);
+
+    printf("  \"files\": [");
+    entries = get_sorted_entries(s->files, compare_files_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(s->files), top); i++) {
+        file_stats *f = (file_stats *)entries[i].value;
+        printf("%s\n    {\"path\": ", i == 0 ? "" : ",");
+        print_json_string(stdout, entries[i].key, entries[i].len);
+        printf(", ");
+        print_json_counts(f);
+        printf(", \"remote\": %s}", f->remote ? "true" : "false");
+    }
+    free(entries);
+    printf("\n  ],\n");
+
+    strmap *directories = get_directories(s);
+    printf("  \"directories\": [");
+    entries = get_sorted_entries(directories, compare_files_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(directories), top); i++) {
+        printf("%s\n    {\"path\": ", i == 0 ? "" : ",");
+        print_json_string(stdout, entries[i].key, entries[i].len);
+        printf(", ");
+        print_json_counts((file_stats *)entries[i].value);
+        printf("}");
+    }
+    free(entries);
+    strmap_free(directories);
+    printf("\n  ],\n");
+
+    printf("  \"programs\": [");
+    entries = get_sorted_entries(s->programs, compare_programs_by_opens);
+    for (size_t i = 0; i < limit(strmap_size(s->programs), top); i++) {
+        program_stats *p = (program_stats *)entries[i].value;
+        printf("%s\n    {\"program\": ", i == 0 ? "" : ",");
+        print_json_string(stdout, entries[i].key, entries[i].len);
+        printf(", \"processes\": %lld, \"calls\": %lld, \"opens\": %lld, \"reads\": %lld, \"writes\": %lld, "
+               "\"remote\": %lld}", p->processes, p->calls, p->opens, p->reads, p->writes, p->remote);
+    }
+    free(entries);
+    printf("\n  ],\n");
+
+    size_t remote_files = 0;
+    const char *key;
+    size_t len;
+    for (size_t i = 0; i < strmap_capacity(s->files); i++) {
+        file_stats *f = (file_stats *)strmap_slot(s->files, i, &key, &len);
+        if (f != NULL && f->remote) {
+            remote_files++;
+        }
+    }
+    printf("  \"remote\": {\"opens\": %lld, \"distinct\": %zu, \"uploads_ok\": %lld, \"uploads_failed\": %lld, "
+           "\"downloads_ok\": %lld, \"downloads_failed\": %lld, \"download_bytes_received\": %lld, "
+           "\"download_bytes_stored\": %lld},\n",
+           s->remote_opens, remote_files, s->uploads_ok, s->uploads_failed, s->downloads_ok, s->downloads_failed,
+           s->download_bytes_received, s->download_bytes_stored);
+
+    printf("  \"processes\": [");
+    entries = get_sorted_entries(s->io, compare_entries_by_key);
+    size_t num_processes = 0;
+    const char *last_process = NULL;
+    size_t last_process_len = 0;
+    bool first_input = true;
+    for (size_t i = 0; i < strmap_size(s->io); i++) {
+        const char *newline = memchr(entries[i].key, '\n', entries[i].len);
+        size_t process_len = newline - entries[i].key;
+        if (last_process == NULL || process_len != last_process_len ||
+            memcmp(last_process, entries[i].key, process_len) != 0) {
+            if (top > 0 && num_processes == (size_t)top) {
+                break;
+            }
+            printf("%s\n    {", last_process == NULL ? "" : "]},");
+            print_json_process(entries[i].key, process_len);
+            printf(", \"files\": [");
+            last_process = entries[i].key;
+            last_process_len = process_len;
+            num_processes++;
+            first_input = true;
+        }
+        int access = ((io_stats *)entries[i].value)->access;
+        printf("%s{\"path\": ", first_input ? "" : ", ");
+        print_json_string(stdout, newline + 1, entries[i].len - process_len - 1);
+        printf(", \"input\": %s, \"output\": %s}", access & ACCESS_READ ? "true" : "false",
+               access & ACCESS_WRITE ? "true" : "false");
+        first_input = false;
+    }
+    free(entries);
+    printf("%s\n  ]\n}\n", last_process == NULL ? "" : "]}");
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi trace summarize [OPTIONS] [LOG_FILE|LOG_DIR ...]\n");
+    fprintf(out, "Summarizes the logs written by libvdi.so. Directories contribute their files\n");
+    fprintf(out, "ending in '.log'. Without arguments the log directory ($VDI_LOG_DIR or\n");
+    fprintf(out, "$HOME/.vdi/logs) is used.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  --json          print the summary as JSON\n");
+    fprintf(out, "  --top N         show only the top N entries of each list (default: %d, 0: all)\n", DEFAULT_TOP);
+    fprintf(out, "  -j, --threads N number of threads (default: number of CPUs)\n");
+    fprintf(out, "  -h, --help      show this help\n");
+}
+
+int summarize_main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"json", no_argument, NULL, 'J'},
+        {"top", required_argument, NULL, 't'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    bool json = false;
+    int top = DEFAULT_TOP;
+    int threads = 0;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'J': json = true; break;
+            case 't': top = atoi(optarg); break;
+            case 'j': threads = atoi(optarg); break;
+            case 'h': usage(stdout); return EXIT_SUCCESS;
+            default: usage(stderr); return EXIT_FAILURE;
+        }
+    }
+
+    char **paths;
+    int num_paths = collect_log_files(argc - optind, argv + optind, &paths);
+    if (num_paths < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    log_file *files = (log_file *)calloc(num_paths + 1, sizeof(log_file));
+    int num_files = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < num_paths; i++) {
+        if (log_file_open(paths[i], &files[num_files]) != 0) {
+            fprintf(stderr, "vdi-trace: cannot read '%s': %s\n", paths[i], strerror(errno));
+            continue;
+        }
+        num_files++;
+    }
+    int num_threads = get_num_threads(threads);
+    decompress_log_files(files, num_files, num_threads);
+    for (int i = 0; i < num_files; i++) {
+        bytes += files[i].size;
+    }
+
+    log_chunk *chunks;
+    int num_chunks = split_into_chunks(files, num_files, CHUNK_SIZE, &chunks);
+    if (num_threads > num_chunks) {
+        num_threads = num_chunks > 0 ? num_chunks : 1;
+    }
+    summary **states = (summary **)malloc(num_threads * sizeof(summary *));
+    for (int t = 0; t < num_threads; t++) {
+        states[t] = summary_create();
+    }
+    process_chunks_in_parallel(chunks, num_chunks, num_threads, summarize_chunk, (void **)states);
+    for (int t = 1; t < num_threads; t++) {
+        merge_summary(states[0], states[t]);
+        summary_free(states[t]);
+    }
+    count_processes_per_program(states[0]);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (json) {
+        print_json(states[0], top, num_files, bytes, seconds);
+    } else {
+        print_table(states[0], top, num_files, bytes, seconds);
+    }
+
+    summary_free(states[0]);
+    free(states);
+    free(chunks);
+    for (int i = 0; i < num_files; i++) {
+        log_file_close(&files[i]);
+    }
+    free(files);
+    for (int i = 0; i < num_paths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,389 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// vdi-top: shows the live statistics of sessions and changes their tracing
+//
+// The processes that libvdi.so traces in a session (VDI_SESSION_ID, set by
+// 'vdi run') count their calls, logged lines, downloads and the time spent
+// logging in a shared-memory segment (see stats_header in trace.h). This
+// program samples the segments of the user's sessions periodically and shows
+// the rates per process, like top. With the control options it changes the
+// control words in the header of a segment instead, which the processes pick
+// up with their next call: pausing and resuming the log, counting calls
+// instead of logging them, the debug level and patterns of the paths to log.
+
+#define DEFAULT_TOP 20
+#define MAX_SESSIONS 64
+
+typedef struct {
+    char *id;
+    stats_header *header;
+    stats_slot previous[STATS_NUM_SLOTS]; // slots at the previous sample
+    bool have_previous;
+    int fd;
+} session;
+
+typedef struct {
+    const stats_slot *slot;
+    double opens_per_second;
+    double lines_per_second;
+    double bytes_per_second;
+    double overhead;           // fraction of the wall-clock time spent in log_call()
+} process_rates;
+
+static volatile sig_atomic_t _stop = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    _stop = 1;
+}
+
+// maps the segment of session id, returns false if it does not exist or is
+// not a file of this user with mode 0600 (as created by libvdi.so)
+static bool open_session(session *s, const char *id) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), STATS_PATH_PREFIX "%u.%s", (unsigned)getuid(), id);
+    size_t size = sizeof(stats_header) + STATS_NUM_SLOTS * sizeof(stats_slot);
+    int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 0777) != 0600 || (size_t)st.st_size < size) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    s->header = (stats_header *)map;
+    if (memcmp(s->header->magic, STATS_MAGIC, sizeof(s->header->magic)) != 0 ||
+        s->header->num_slots != STATS_NUM_SLOTS) {
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+    s->id = strdup(id);
+    s->fd = fd;
+    s->have_previous = false;
+    return true;
+}
+
+static void close_session(session *s) {
+    munmap(s->header, sizeof(stats_header) + STATS_NUM_SLOTS * sizeof(stats_slot));
+    close(s->fd);
+    free(s->id);
+}
+
+// opens the segments of all sessions of the user
+static int open_all_sessions(session *sessions, int max_sessions) {
+    char prefix[PATH_MAX];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s%u.", strrchr(STATS_PATH_PREFIX, '/') + 1, (unsigned)getuid());
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(strrchr(STATS_PATH_PREFIX, '/') - STATS_PATH_PREFIX),
+             STATS_PATH_PREFIX);
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n < max_sessions) {
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0 && open_session(&sessions[n], entry->d_name + prefix_len)) {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static stats_slot *get_slots(stats_header *header) {
+    return (stats_slot *)(header + 1);
+}
+
+static bool is_running(const stats_slot *slot) {
+    return slot->pid > 0 && slot->exit_time == 0 && (kill(slot->pid, 0) == 0 || errno == EPERM);
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int compare_rates(const void *a, const void *b) {
+    const process_rates *x = (const process_rates *)a;
+    const process_rates *y = (const process_rates *)b;
+    if (x->opens_per_second != y->opens_per_second) {
+        return x->opens_per_second < y->opens_per_second ? 1 : -1;
+    }
+    return x->slot->pid - y->slot->pid;
+}
+
+static void print_control(const stats_header *header) {
+    printf("  tracing: %s, %s, debug level: ", header->paused ? "paused" : "active",
+           header->counters_only ? "counting calls only" : "logging lines");
+    if (header->debug_level >= 0) {
+        printf("%d", header->debug_level);
+    } else {
+        printf("from VDI_LOG_DEBUG_LEVEL");
+    }
+    printf(", paths: %s\n", header->match[0] == '\0' ? "all" : header->match);
+}
+
+// prints the session with the rates since the previous sample (or since the
+// start of the processes for the first sample)
+static void print_session(session *s, double interval, bool all, int top) {
+    stats_slot *slots = get_slots(s->header);
+    process_rates *rates = (process_rates *)calloc(STATS_NUM_SLOTS, sizeof(process_rates));
+    stats_slot *current = (stats_slot *)malloc(STATS_NUM_SLOTS * sizeof(stats_slot));
+    time_t now = time(NULL);
+    int num_rates = 0;
+    int running = 0;
+    int exited = 0;
+    process_rates total;
+    memset(&total, 0, sizeof(total));
+    uint64_t dropped = 0;
+    uint64_t downloads = 0;
+    uint64_t download_bytes = 0;
+    int64_t in_flight = 0;
+    uint64_t cache_hits = 0;
+    for (uint32_t i = 0; i < STATS_NUM_SLOTS; i++) {
+        current[i] = slots[i];
+        const stats_slot *slot = &current[i];
+        if (slot->pid <= 0) {
+            continue;
+        }
+        bool alive = is_running(slot);
+        alive ? running++ : exited++;
+        const stats_slot *previous = &s->previous[i];
+        bool same = s->have_previous && previous->pid == slot->pid && previous->start_time == slot->start_time;
+        double seconds = same ? interval : (double)(now - slot->start_time);
+        if (seconds <= 0) {
+            seconds = 1;
+        }
+        process_rates r;
+        r.slot = slot;
+        r.opens_per_second = (load(&slot->opens) - (same ? previous->opens : 0)) / seconds;
+        r.lines_per_second = (load(&slot->logged_lines) - (same ? previous->logged_lines : 0)) / seconds;
+        r.bytes_per_second = (load(&slot->logged_bytes) - (same ? previous->logged_bytes : 0)) / seconds;
+        r.overhead = (load(&slot->overhead_ns) - (same ? previous->overhead_ns : 0)) / (seconds * 1e9);
+        if (alive) {
+            total.opens_per_second += r.opens_per_second;
+            total.lines_per_second += r.lines_per_second;
+            total.bytes_per_second += r.bytes_per_second;
+            in_flight += slot->downloads_in_flight;
+        }
+        dropped += slot->dropped;
+        downloads += slot->downloads;
+        download_bytes += slot->download_bytes;
+        cache_hits += slot->cache_hits;
+        if (alive || all) {
+            rates[num_rates++] = r;
+        }
+    }
+    memcpy(s->previous, current, sizeof(s->previous));
+    s->have_previous = true;
+
+    char buffer[3][32];
+    printf("session %s: %d running, %d exited process(es)\n", s->id, running, exited);
+    print_control(s->header);
+    printf("  %.0f opens/s, %.0f lines/s (%s/s) logged, %llu calls not logged\n", total.opens_per_second,
+           total.lines_per_second, format_bytes(total.bytes_per_second, buffer[0], sizeof(buffer[0])),
+           (unsigned long long)dropped);
+    printf("  downloads: %lld in flight, %llu done (%s), %llu cache hits\n", (long long)in_flight,
+           (unsigned long long)downloads, format_bytes(download_bytes, buffer[1], sizeof(buffer[1])),
+           (unsigned long long)cache_hits);
+
+    qsort(rates, num_rates, sizeof(process_rates), compare_rates);
+    printf("\n%8s %-16s %10s %10s %10s %10s %10s %4s %10s %6s %9s\n", "PID", "PROGRAM", "OPENS/S", "OPENS",
+           "LINES/S", "LOG/S", "DROPPED", "DL", "DL BYTES", "HITS", "OVERHEAD");
+    int shown = top > 0 && top < num_rates ? top : num_rates;
+    for (int i = 0; i < shown; i++) {
+        const stats_slot *slot = rates[i].slot;
+        printf("%8d %-16.16s %10.0f %10llu %10.0f %10s %10llu %4lld %10s %6llu %8.2f%%%s\n", slot->pid,
+               slot->program, rates[i].opens_per_second, (unsigned long long)slot->opens, rates[i].lines_per_second,
+               format_bytes(rates[i].bytes_per_second, buffer[0], sizeof(buffer[0])),
+               (unsigned long long)slot->dropped, (long long)slot->downloads_in_flight,
+               format_bytes(slot->download_bytes, buffer[1], sizeof(buffer[1])),
+               (unsigned long long)slot->cache_hits, 100.0 * rates[i].overhead, is_running(slot) ? "" : " (exited)");
+    }
+    if (shown < num_rates) {
+        printf("  ... (%d more, use --top 0 to show all)\n", num_rates - shown);
+    }
+    free(current);
+    free(rates);
+}
+
+typedef struct {
+    int paused;                // -1: unchanged
+    int counters_only;         // -1: unchanged
+    int debug_level;           // -2: unchanged
+    const char *match;         // NULL: unchanged
+} control_change;
+
+// changes the control words of the session under its sequence lock; the
+// flock serializes concurrent changes
+static void change_control(session *s, const control_change *change) {
+    while (flock(s->fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+    stats_header *header = s->header;
+    __atomic_add_fetch(&header->control_seq, 1, __ATOMIC_ACQ_REL); // odd: changing
+    if (change->paused >= 0) {
+        header->paused = change->paused;
+    }
+    if (change->counters_only >= 0) {
+        header->counters_only = change->counters_only;
+    }
+    if (change->debug_level >= -1) {
+        header->debug_level = change->debug_level;
+    }
+    if (change->match != NULL) {
+        snprintf(header->match, sizeof(header->match), "%s", change->match);
+    }
+    __atomic_add_fetch(&header->control_seq, 1, __ATOMIC_RELEASE); // even: done
+    flock(s->fd, LOCK_UN);
+}
+
+static void usage(FILE *out) {
+    fprintf(out, "Usage: vdi top [OPTIONS]\n");
+    fprintf(out, "Shows the live statistics of the processes that libvdi.so traces in a session\n");
+    fprintf(out, "(VDI_SESSION_ID, set by 'vdi run') and changes their tracing while they run.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  -s, --session ID     session to show or change (default: $VDI_SESSION_ID or all\n");
+    fprintf(out, "                       sessions of the user)\n");
+    fprintf(out, "  -d, --interval SEC   seconds between updates (default: 1)\n");
+    fprintf(out, "  -n, --iterations N   stop after N updates (default: 0, until interrupted)\n");
+    fprintf(out, "  -a, --all            also show processes that have exited\n");
+    fprintf(out, "  --top N              show the N busiest processes (default: %d, 0: all)\n", DEFAULT_TOP);
+    fprintf(out, "Control (changes the session and exits):\n");
+    fprintf(out, "  --pause              stop logging calls\n");
+    fprintf(out, "  --resume             resume logging calls\n");
+    fprintf(out, "  --counters-only      only count calls, written as 'vdi_counters' lines at exit\n");
+    fprintf(out, "  --log                log lines again after --counters-only\n");
+    fprintf(out, "  --debug N            set the debug level of libvdi.so (-1: VDI_LOG_DEBUG_LEVEL)\n");
+    fprintf(out, "  --match PATTERNS     only log paths matching shell patterns separated by '%s'\n",
+            STATS_MATCH_SEPARATOR);
+    fprintf(out, "                       (absolute paths or URLs, '' logs all paths)\n");
+    fprintf(out, "  -h, --help           show this help\n");
+}
+
+int main(int argc, char **argv) {
+    enum { OPT_TOP = 256, OPT_PAUSE, OPT_RESUME, OPT_COUNTERS_ONLY, OPT_LOG, OPT_DEBUG, OPT_MATCH };
+    static struct option long_options[] = {
+        {"session", required_argument, NULL, 's'},
+        {"interval", required_argument, NULL, 'd'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"all", no_argument, NULL, 'a'},
+        {"top", required_argument, NULL, OPT_TOP},
+        {"pause", no_argument, NULL, OPT_PAUSE},
+        {"resume", no_argument, NULL, OPT_RESUME},
+        {"counters-only", no_argument, NULL, OPT_COUNTERS_ONLY},
+        {"log", no_argument, NULL, OPT_LOG},
+        {"debug", required_argument, NULL, OPT_DEBUG},
+        {"match", required_argument, NULL, OPT_MATCH},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *session_id = getenv("VDI_SESSION_ID");
+    double interval = 1.0;
+    long iterations = 0;
+    bool all = false;
+    int top = DEFAULT_TOP;
+    control_change change = { -1, -1, -2, NULL };
+    bool control = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:d:n:ah", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's': session_id = optarg; break;
+            case 'd': interval = atof(optarg); break;
+            case 'n': iterations = atol(optarg); break;
+            case 'a': all = true; break;
+            case OPT_TOP: top = atoi(optarg); break;
+            case OPT_PAUSE: change.paused = 1; control = true; break;
+            case OPT_RESUME: change.paused = 0; control = true; break;
+            case OPT_COUNTERS_ONLY: change.counters_only = 1; control = true; break;
+            case OPT_LOG: change.counters_only = 0; control = true; break;
+            case OPT_DEBUG: change.debug_level = atoi(optarg) < -1 ? -1 : atoi(optarg); control = true; break;
+            case OPT_MATCH: change.match = optarg; control = true; break;
+            case 'h': usage(stdout); return EXIT_SUCCESS;
+            default: usage(stderr); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || interval <= 0) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    session *sessions = (session *)calloc(MAX_SESSIONS, sizeof(session));
+    int num_sessions;
+    if (session_id != NULL && session_id[0] != '\0') {
+        num_sessions = open_session(&sessions[0], session_id) ? 1 : 0;
+        if (num_sessions == 0) {
+            fprintf(stderr, "vdi-top: no statistics of session '%s' on this node\n", session_id);
+            free(sessions);
+            return EXIT_FAILURE;
+        }
+    } else {
+        num_sessions = open_all_sessions(sessions, MAX_SESSIONS);
+        if (num_sessions == 0) {
+            fprintf(stderr, "vdi-top: no sessions of user %u on this node (run programs with 'vdi run')\n",
+                    (unsigned)getuid());
+            free(sessions);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (control) {
+        for (int i = 0; i < num_sessions; i++) {
+            change_control(&sessions[i], &change);
+            printf("session %s:\n", sessions[i].id);
+            print_control(sessions[i].header);
+            close_session(&sessions[i]);
+        }
+        free(sessions);
+        return EXIT_SUCCESS;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    bool clear = isatty(STDOUT_FILENO) && iterations != 1;
+    struct timespec delay = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+    for (long iteration = 0; !_stop && (iterations == 0 || iteration < iterations); iteration++) {
+        if (iteration > 0) {
+            nanosleep(&delay, NULL);
+            if (_stop) {
+                break;
+            }
+        }
+        if (clear) {
+            printf("\033[H\033[2J");
+        }
+        for (int i = 0; i < num_sessions; i++) {
+            if (i > 0) {
+                printf("\n");
+            }
+            print_session(&sessions[i], interval, all, top);
+        }
+        if (!clear && (iterations == 0 || iteration + 1 < iterations)) {
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+    for (int i = 0; i < num_sessions; i++) {
+        close_session(&sessions[i]);
+    }
+    free(sessions);
+    return EXIT_SUCCESS;
+}
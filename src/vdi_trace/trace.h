@@ -0,0 +1,252 @@
+#ifndef VDI_TRACE_H
+#define VDI_TRACE_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// columns of a log line (see src/vdi_wrapper/README.md), numbered from zero
+enum {
+    COL_TIME = 0,
+    COL_HOST,
+    COL_USER,
+    COL_HOME,
+    COL_PID,
+    COL_PPID,
+    COL_PGID,
+    COL_CWD,
+    COL_PROGRAM,
+    COL_ARGS,
+    COL_START,
+    COL_ELAPSED,
+    COL_FUNC,
+    COL_FIRST_ARG,
+    MAX_COLUMNS = 24
+};
+
+// a field points into the (memory-mapped) log data, it is not null-terminated
+typedef struct {
+    const char *ptr;
+    size_t len;
+} field;
+
+typedef struct {
+    field columns[MAX_COLUMNS];
+    int num_columns;
+} log_record;
+
+// access mode of an open event
+enum {
+    ACCESS_READ = 1,
+    ACCESS_WRITE = 2
+};
+
+// an open event (open, open64, openat, fopen, fopen64, fopenat, freopen)
+typedef struct {
+    field path;
+    int dirfd;     // AT_FDCWD (-100) if the call has no dirfd
+    int access;    // ACCESS_READ and/or ACCESS_WRITE
+    bool remote;   // path is a URL or vdi:// path
+} open_event;
+
+// parse.c
+int split_record(const char *line, size_t len, log_record *record);
+bool parse_open_event(const log_record *record, open_event *event);
+bool field_equals(field f, const char *str);
+long long field_to_ll(field f);
+size_t make_absolute_path(field cwd, field path, char *buffer, size_t size);
+size_t get_process_key(const log_record *record, char *buffer, size_t size);
+int64_t get_record_time_us(const log_record *record);
+
+// hashmap.c: maps byte strings to fixed-size values (zero-initialized on insert)
+typedef struct strmap strmap;
+uint64_t hash_bytes(const char *data, size_t len);
+strmap *strmap_create(size_t value_size);
+void strmap_free(strmap *map);
+void *strmap_insert(strmap *map, const char *key, size_t len);
+void *strmap_find(const strmap *map, const char *key, size_t len);
+size_t strmap_size(const strmap *map);
+size_t strmap_capacity(const strmap *map);
+// returns the value of slot i (and its key) or NULL if the slot is empty
+void *strmap_slot(const strmap *map, size_t i, const char **key, size_t *len);
+
+// logfile.c
+typedef struct {
+    char *path;
+    const char *data;
+    size_t size;
+    void *mapping;      // memory-mapped file or NULL
+    size_t mapping_size;
+    char *buffer;       // decompressed content of a compressed file or NULL
+} log_file;
+
+int log_file_open(const char *path, log_file *file);
+void log_file_close(log_file *file);
+int collect_log_files(int num_args, char **args, char ***paths);
+char *get_default_log_dir(void);
+
+// a chunk of a log file that starts at a line boundary and ends after a newline
+typedef struct {
+    int file_index;
+    const char *data;
+    size_t size;
+} log_chunk;
+
+int split_into_chunks(log_file *files, int num_files, size_t chunk_size, log_chunk **chunks);
+typedef void (*chunk_function)(void *state, const log_chunk *chunk);
+void process_chunks_in_parallel(log_chunk *chunks, int num_chunks, int num_threads,
+                                chunk_function function, void **states);
+int get_num_threads(int requested);
+
+// decompress.c
+typedef enum {
+    LOG_COMPRESSION_NONE = 0,
+    LOG_COMPRESSION_ZSTD,
+    LOG_COMPRESSION_LZ4
+} log_compression;
+
+log_compression get_log_compression(const char *data, size_t size);
+int decompress_log_file(log_file *file);
+void decompress_log_files(log_file *files, int num_files, int num_threads);
+
+// reads a log file line by line, compressed files through a window that only
+// grows for lines longer than the window
+#define LOG_READER_WINDOW_SIZE (256 * 1024)
+
+typedef struct {
+    log_file *file;
+    log_compression compression;
+    void *context;       // zstd or LZ4 decompression context
+    size_t in_pos;       // consumed bytes of the compressed data
+    size_t pending;      // non-zero while a frame is incomplete
+    char *window;
+    size_t window_size;
+    size_t start;        // next line (offset into the window or the file)
+    size_t end;          // end of the decompressed data in the window
+    bool eof;
+} log_reader;
+
+int log_reader_open(log_file *file, log_reader *reader);
+const char *log_reader_next(log_reader *reader, size_t *len);
+void log_reader_close(log_reader *reader);
+
+// compress.c
+typedef struct {
+    log_compression compression;
+    int level;
+} compressor;
+
+int init_compressor(const char *spec, compressor *c);
+const char *get_compression_suffix(const compressor *c);
+char *compress_frame(const compressor *c, const char *data, size_t size, size_t *frame_size);
+
+// wire format of the datagrams libvdi.so sends to vdi-collectord: the magic
+// 'VDI1', the session id (VDI_SESSION_ID) terminated by a null byte and one
+// or more complete log lines
+#define COLLECTOR_MAGIC "VDI1"
+#define COLLECTOR_MAGIC_LEN 4
+#define COLLECTOR_MAX_SESSION_LEN 255
+// default socket, overridden by VDI_COLLECTOR_SOCKET (same in libvdi.so)
+#define COLLECTOR_SOCKET_TEMPLATE "/tmp/vdi-collectord.%s.sock"   // USER
+#define COLLECTOR_ENVVAR_SOCKET "VDI_COLLECTOR_SOCKET"
+
+// index of the download cache (DOWNLOAD_BASE/.vdi_cache.index), a table of
+// fixed-size slots addressed by the FNV-1a hash of the file name with linear
+// probing; changed only while holding an exclusive flock on
+// DOWNLOAD_BASE/.vdi_cache.lock (same layout in libvdi.so)
+#define CACHE_INDEX_FILENAME ".vdi_cache.index"
+#define CACHE_LOCK_FILENAME ".vdi_cache.lock"
+#define CACHE_INDEX_MAGIC "VDICACH2"
+#define CACHE_INITIAL_CAPACITY 4096
+#define CACHE_ENVVAR_MAX_BYTES "VDI_DOWNLOAD_MAX_BYTES"
+#define CACHE_MAX_BYTES_DEFAULT "25%"
+
+typedef struct {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t num_entries;
+    uint32_t num_deleted;
+    uint32_t reserved;
+    uint64_t total_bytes;
+    uint64_t hits;
+    uint64_t downloads;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+} cache_index_header;
+
+enum { CACHE_SLOT_EMPTY = 0, CACHE_SLOT_USED, CACHE_SLOT_DELETED };
+
+typedef struct {
+    uint64_t hash;
+    uint64_t size;
+    int64_t last_access;
+    uint32_t hits;
+    uint32_t state;
+    char name[NAME_MAX + 1];
+} cache_slot;
+
+// live statistics and control of a session (/dev/shm/vdi_stats.UID.SESSION_ID):
+// a header with control words, changed under a sequence lock, followed by one
+// slot per process with counters that the process increments atomically
+// (same layout in libvdi.so)
+#define STATS_PATH_PREFIX "/dev/shm/vdi_stats."
+#define STATS_MAGIC "VDISTAT1"
+#define STATS_NUM_SLOTS 1024
+#define STATS_MATCH_SEPARATOR ":"
+
+typedef struct {
+    char magic[8];
+    uint32_t num_slots;
+    uint32_t control_seq;
+    uint32_t paused;
+    uint32_t counters_only;
+    int32_t debug_level;
+    uint32_t reserved;
+    char match[256];
+    char reserved2[32];
+} stats_header;
+
+typedef struct {
+    int32_t pid;
+    uint32_t reserved;
+    int64_t start_time;
+    int64_t exit_time;
+    char program[40];
+    uint64_t opens;
+    uint64_t logged_lines;
+    uint64_t logged_bytes;
+    uint64_t dropped;
+    uint64_t overhead_ns;
+    uint64_t downloads;
+    uint64_t download_bytes;
+    int64_t downloads_in_flight;
+    uint64_t cache_hits;
+    uint64_t reserved2[7];
+} stats_slot;
+
+// output.c
+typedef struct {
+    const char *key;
+    size_t len;
+    void *value;
+} map_entry;
+
+void print_json_string(FILE *out, const char *str, size_t len);
+map_entry *get_sorted_entries(const strmap *map, int (*compare)(const void *, const void *));
+int compare_entries_by_key(const void *a, const void *b);
+const char *format_bytes(double bytes, char *buffer, size_t size);
+
+// commands
+int summarize_main(int argc, char **argv);
+int cat_main(int argc, char **argv);
+int index_main(int argc, char **argv);
+int who_read_main(int argc, char **argv);
+int inputs_main(int argc, char **argv);
+int replay_main(int argc, char **argv);
+int merge_main(int argc, char **argv);
+int diff_main(int argc, char **argv);
+
+#endif
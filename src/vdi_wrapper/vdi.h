@@ -0,0 +1,74 @@
+// hint interface of libvdi.so
+//
+// Applications that know their inputs before they open them can ask the
+// library to download them ahead, drop downloaded copies they no longer need,
+// write the buffered log and read the counters of the process. The functions
+// are only available while the library is preloaded, so applications look
+// them up at run time and carry on without them otherwise, e.g.,
+//
+//     int (*prefetch)(const char *) = (int (*)(const char *))dlsym(RTLD_DEFAULT, "vdi_prefetch");
+//     if (prefetch != NULL) {
+//         prefetch("vdi://era5/2020/t2m.nc");
+//     }
+//
+// Paths are URLs, vdi://VIEW/FILE paths or paths mapped by VDI_MAP. The
+// functions return 0 on success and -1 with errno set on failure. Only
+// additions are made to this interface; VDI_API_VERSION is incremented with
+// each of them.
+#ifndef VDI_H
+#define VDI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VDI_API_VERSION 1
+
+// counters of the calling process since it started (a forked child starts
+// with those of its parent); the caller sets size to sizeof(struct vdi_stats),
+// the library fills in the fields it knows up to that size and sets version
+struct vdi_stats {
+    uint32_t size;
+    uint32_t version;              // VDI_API_VERSION of the library
+    uint64_t opens;                // intercepted calls
+    uint64_t logged_lines;
+    uint64_t logged_bytes;
+    uint64_t dropped;              // calls not logged (budget, sampling, pause, patterns)
+    uint64_t downloads;
+    uint64_t download_bytes;       // received
+    int64_t downloads_in_flight;
+    uint64_t cache_hits;           // opens served from the download directory
+    uint64_t prefetches_queued;    // by vdi_prefetch and by the learned prefetching
+    uint64_t prefetches_done;      // downloaded
+    uint64_t prefetches_cached;    // found in the download directory
+    uint64_t prefetches_failed;    // including those cancelled at exit
+    uint64_t prefetches_used;      // opened after they were prefetched
+};
+
+// queues path for a download in the background with the priority of
+// prefetches; an open of path uses the download (or waits for it if it is
+// still in flight); a local path is ignored
+int vdi_prefetch(const char *path);
+
+// queues count paths as vdi_prefetch does; returns the number queued
+int vdi_prefetch_many(const char *const *paths, size_t count);
+
+// removes the downloaded copy of path from the download directory; fails
+// with EBUSY if a program has it open and with ENOENT if there is none
+int vdi_evict(const char *path);
+
+// writes the log lines the process has buffered and the counts of calls it
+// did not log (as before an exec)
+int vdi_flush_log(void);
+
+// fills in stats, see struct vdi_stats
+int vdi_get_stats(struct vdi_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif